@@ -0,0 +1,510 @@
+#ifndef _ASYNC_IO_H
+#define _ASYNC_IO_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <threads.h>
+
+#include "DynamicString.h"
+
+// whole file reads and writes that run in the background, many at a time
+// io_uring on linux when the kernel allows it, a pool of blocking worker threads otherwise
+// a request buffer must not be touched between AsyncIOSubmit() and the AsyncIOWait() that returns it
+// on linux the implementation needs _GNU_SOURCE defined before the first system header is included
+
+typedef enum {
+    AsyncIORead,  // the whole file is appended to buffer
+    AsyncIOWrite, // the whole buffer replaces the file
+} AsyncIOOp;
+
+typedef struct AsyncIORequest {
+    AsyncIOOp op;
+    const char *path;
+    DynamicString *buffer;
+    void *userData;
+    int error; // errno of the step that failed, 0 on success
+
+    // backend state
+    int fd;
+    int stage;
+    size_t done;     // bytes transferred so far
+    size_t expected; // size of the file being read from fstat, 0 when it is not known
+    struct AsyncIORequest *next;
+} AsyncIORequest;
+
+#ifndef ASYNC_IO_READ_CHUNK
+#    define ASYNC_IO_READ_CHUNK (64 * 1024)
+#endif // ASYNC_IO_READ_CHUNK
+
+typedef struct {
+    bool uring;
+    size_t inflight;
+    AsyncIORequest *doneHead; // finished but not returned by AsyncIOWait() yet
+    AsyncIORequest *doneTail;
+
+#ifdef __linux__
+    int ringFd;
+    unsigned sqEntries;
+    unsigned toSubmit;
+    void *sqRing;
+    void *cqRing;
+    size_t sqRingSize;
+    size_t cqRingSize;
+    struct io_uring_sqe *sqes;
+    unsigned *sqHead;
+    unsigned *sqTail;
+    unsigned *sqMask;
+    unsigned *sqArray;
+    unsigned *cqHead;
+    unsigned *cqTail;
+    unsigned *cqMask;
+    struct io_uring_cqe *cqes;
+#endif // __linux__
+
+    thrd_t *workers;
+    size_t workerCount;
+    mtx_t lock;
+    cnd_t submitted;
+    cnd_t completed;
+    AsyncIORequest *pendingHead;
+    AsyncIORequest *pendingTail;
+    bool stopping;
+} AsyncIO;
+
+bool AsyncIOInit(AsyncIO *io, unsigned entries, size_t workerCount);
+void AsyncIOSubmit(AsyncIO *io, AsyncIORequest *request);
+AsyncIORequest *AsyncIOWait(AsyncIO *io);
+void AsyncIODestroy(AsyncIO *io);
+
+#ifdef ASYNC_IO_IMPLEMENTATION
+
+#    ifdef _WIN32
+#        define ASYNC_IO_POSIX (0)
+#    else
+#        define ASYNC_IO_POSIX (1)
+#        include <fcntl.h>
+#        include <sys/stat.h>
+#        include <unistd.h>
+#    endif // _WIN32
+
+#    if defined(__linux__) && !defined(ASYNC_IO_NO_URING)
+#        define ASYNC_IO_URING (1)
+#    else
+#        define ASYNC_IO_URING (0)
+#    endif // __linux__ && !ASYNC_IO_NO_URING
+
+#    ifdef __linux__
+#        include <linux/io_uring.h>
+#        include <stdatomic.h>
+#        include <sys/mman.h>
+#        include <sys/syscall.h>
+#    endif // __linux__
+
+static void AsyncIOListPush(AsyncIORequest **head, AsyncIORequest **tail, AsyncIORequest *request) {
+    request->next = NULL;
+    if (*tail) {
+        (*tail)->next = request;
+    } else {
+        *head = request;
+    }
+    *tail = request;
+}
+
+static AsyncIORequest *AsyncIOListPop(AsyncIORequest **head, AsyncIORequest **tail) {
+    AsyncIORequest *request = *head;
+    if (request) {
+        *head = request->next;
+        if (!*head) *tail = NULL;
+    }
+    return request;
+}
+
+#    if ASYNC_IO_POSIX
+// the buffer of a read gets room for the whole file at once, or a chunk when its size is not known
+static void AsyncIOReserveRead(AsyncIORequest *request, int fd) {
+    struct stat st;
+    request->expected = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 ? (size_t) st.st_size : 0;
+    size_t reserve = request->expected > 0 ? request->expected : ASYNC_IO_READ_CHUNK;
+    DynamicStringReserve(request->buffer, request->buffer->count + reserve + 1);
+}
+#    endif // ASYNC_IO_POSIX
+
+#    ifdef __linux__
+
+// stages of a request, each one is a single operation in the ring
+// except a transfer linked to the close after it, see AsyncIOUringLinksClose()
+enum {
+    AsyncIOStageOpen,
+    AsyncIOStageTransfer,
+    AsyncIOStageClose,
+};
+
+#        define ASYNC_IO_URING_PROBE_OPS (256)
+
+// io_uring_setup works from 5.1 but open, read, write and close only became ring opcodes in 5.6,
+// so the opcodes are probed and a kernel missing any of them gets the thread pool instead
+static bool AsyncIOUringSupported(int ringFd) {
+    static const unsigned char neededOps[] = {IORING_OP_OPENAT, IORING_OP_READ, IORING_OP_WRITE, IORING_OP_CLOSE};
+    union {
+        struct io_uring_probe probe;
+        unsigned char bytes[sizeof(struct io_uring_probe) + ASYNC_IO_URING_PROBE_OPS * sizeof(struct io_uring_probe_op)];
+    } probe;
+    memset(&probe, 0, sizeof(probe));
+    // kernels before 5.6 dont know IORING_REGISTER_PROBE either and fail with EINVAL
+    if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, &probe, ASYNC_IO_URING_PROBE_OPS) < 0) return false;
+
+    for (size_t i = 0; i < sizeof(neededOps); i++) {
+        unsigned char op = neededOps[i];
+        if (op >= probe.probe.ops_len || !(probe.probe.ops[op].flags & IO_URING_OP_SUPPORTED)) return false;
+    }
+    return true;
+}
+
+static bool AsyncIOUringInit(AsyncIO *io, unsigned entries) {
+    struct io_uring_params params = {0};
+    io->ringFd = (int) syscall(__NR_io_uring_setup, entries, &params);
+    if (io->ringFd < 0) return false;
+    if (!AsyncIOUringSupported(io->ringFd)) {
+        close(io->ringFd);
+        return false;
+    }
+
+    io->sqEntries = params.sq_entries;
+    io->sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    io->cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool singleMmap = params.features & IORING_FEAT_SINGLE_MMAP;
+    if (singleMmap) {
+        if (io->cqRingSize > io->sqRingSize) io->sqRingSize = io->cqRingSize;
+        io->cqRingSize = io->sqRingSize;
+    }
+
+    io->sqRing = mmap(NULL, io->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_SQ_RING);
+    io->cqRing = singleMmap ? io->sqRing : mmap(NULL, io->cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_CQ_RING);
+    io->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, io->ringFd, IORING_OFF_SQES);
+    if (io->sqRing == MAP_FAILED || io->cqRing == MAP_FAILED || io->sqes == MAP_FAILED) {
+        if (io->sqRing != MAP_FAILED) munmap(io->sqRing, io->sqRingSize);
+        if (!singleMmap && io->cqRing != MAP_FAILED) munmap(io->cqRing, io->cqRingSize);
+        if (io->sqes != MAP_FAILED) munmap(io->sqes, params.sq_entries * sizeof(struct io_uring_sqe));
+        close(io->ringFd);
+        return false;
+    }
+
+    char *sq = io->sqRing;
+    char *cq = io->cqRing;
+    io->sqHead = (unsigned *) (sq + params.sq_off.head);
+    io->sqTail = (unsigned *) (sq + params.sq_off.tail);
+    io->sqMask = (unsigned *) (sq + params.sq_off.ring_mask);
+    io->sqArray = (unsigned *) (sq + params.sq_off.array);
+    io->cqHead = (unsigned *) (cq + params.cq_off.head);
+    io->cqTail = (unsigned *) (cq + params.cq_off.tail);
+    io->cqMask = (unsigned *) (cq + params.cq_off.ring_mask);
+    io->cqes = (struct io_uring_cqe *) (cq + params.cq_off.cqes);
+    io->uring = true;
+    return true;
+}
+
+static void AsyncIOUringFlush(AsyncIO *io, unsigned minComplete) {
+    for (;;) {
+        int ret = (int) syscall(__NR_io_uring_enter, io->ringFd, io->toSubmit, minComplete,
+                                minComplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0) {
+            io->toSubmit -= (unsigned) ret < io->toSubmit ? (unsigned) ret : io->toSubmit;
+            return;
+        }
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+            abort();
+        }
+    }
+}
+
+// waits until count entries are free in the submission queue, so linked entries go to the kernel together
+static void AsyncIOUringReserve(AsyncIO *io, unsigned count) {
+    while (*io->sqTail - atomic_load_explicit((_Atomic unsigned *) io->sqHead, memory_order_acquire) + count > io->sqEntries) {
+        AsyncIOUringFlush(io, 0);
+    }
+}
+
+static struct io_uring_sqe *AsyncIOUringGetSqe(AsyncIO *io, AsyncIORequest *request, int opcode) {
+    AsyncIOUringReserve(io, 1);
+    unsigned tail = *io->sqTail;
+    unsigned idx = tail & *io->sqMask;
+    struct io_uring_sqe *sqe = &io->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = (unsigned char) opcode;
+    sqe->user_data = (unsigned long long) (uintptr_t) request;
+    io->sqArray[idx] = idx;
+    atomic_store_explicit((_Atomic unsigned *) io->sqTail, tail + 1, memory_order_release);
+    io->toSubmit++;
+    return sqe;
+}
+
+// a write, or a read of a file whose size is known, is done in one operation, so the close is linked after it
+// and runs as soon as the transfer finishes instead of waiting for AsyncIOWait() to submit it
+// a read of unknown size goes on chunk by chunk until a read returns 0
+// a file that grows between the fstat and the read is read up to the size it had
+static bool AsyncIOUringLinksClose(const AsyncIORequest *request) {
+    return request->op == AsyncIOWrite || request->expected > 0;
+}
+
+static void AsyncIOUringSubmitStage(AsyncIO *io, AsyncIORequest *request) {
+    struct io_uring_sqe *sqe = NULL;
+    switch (request->stage) {
+        case AsyncIOStageOpen:
+            sqe = AsyncIOUringGetSqe(io, request, IORING_OP_OPENAT);
+            sqe->fd = AT_FDCWD;
+            sqe->addr = (unsigned long long) (uintptr_t) request->path;
+            sqe->open_flags = request->op == AsyncIORead ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+            sqe->len = 0666;
+            break;
+        case AsyncIOStageTransfer:
+            if (AsyncIOUringLinksClose(request)) AsyncIOUringReserve(io, 2);
+            if (request->op == AsyncIORead) {
+                if (request->buffer->capacity - request->buffer->count < 2) {
+                    DynamicStringReserve(request->buffer, request->buffer->count + ASYNC_IO_READ_CHUNK + 1);
+                }
+                sqe = AsyncIOUringGetSqe(io, request, IORING_OP_READ);
+                sqe->addr = (unsigned long long) (uintptr_t) (request->buffer->data + request->buffer->count);
+                sqe->len = (unsigned) (request->buffer->capacity - request->buffer->count - 1);
+            } else {
+                sqe = AsyncIOUringGetSqe(io, request, IORING_OP_WRITE);
+                sqe->addr = (unsigned long long) (uintptr_t) (request->buffer->data + request->done);
+                sqe->len = (unsigned) (request->buffer->count - request->done);
+            }
+            sqe->fd = request->fd;
+            sqe->off = request->done;
+            if (AsyncIOUringLinksClose(request)) {
+                // a hard link runs the close whatever the transfer returned, so the fd is never leaked
+                sqe->flags |= IOSQE_IO_HARDLINK;
+                sqe = AsyncIOUringGetSqe(io, request, IORING_OP_CLOSE);
+                sqe->fd = request->fd;
+            }
+            break;
+        case AsyncIOStageClose:
+            sqe = AsyncIOUringGetSqe(io, request, IORING_OP_CLOSE);
+            sqe->fd = request->fd;
+            break;
+        default: abort();
+    }
+}
+
+// moves the request to its next stage, returns true once it is finished
+static bool AsyncIOUringAdvance(AsyncIO *io, AsyncIORequest *request, int res) {
+    if (request->stage == AsyncIOStageClose) {
+        if (res < 0 && request->error == 0) request->error = -res;
+        return true;
+    }
+    bool linked = request->stage == AsyncIOStageTransfer && AsyncIOUringLinksClose(request);
+    if (res < 0) {
+        request->error = -res;
+        if (request->stage == AsyncIOStageOpen) return true;
+        request->stage = AsyncIOStageClose;
+        if (!linked) AsyncIOUringSubmitStage(io, request);
+        return false;
+    }
+
+    if (request->stage == AsyncIOStageOpen) {
+        request->fd = res;
+        if (request->op == AsyncIORead) AsyncIOReserveRead(request, res);
+        request->stage = request->op == AsyncIOWrite && request->buffer->count == 0 ? AsyncIOStageClose : AsyncIOStageTransfer;
+    } else if (request->op == AsyncIORead) {
+        request->done += (size_t) res;
+        request->buffer->count += (size_t) res;
+        request->buffer->data[request->buffer->count] = '\0';
+        if (res == 0 || linked) request->stage = AsyncIOStageClose;
+    } else {
+        request->done += (size_t) res;
+        if (request->done == request->buffer->count) {
+            request->stage = AsyncIOStageClose;
+        } else if (linked) {
+            // the file is already being closed, the rest cannot be written
+            request->error = EIO;
+            request->stage = AsyncIOStageClose;
+        }
+    }
+    // the close linked to the transfer is already in the ring
+    if (!linked || request->stage != AsyncIOStageClose) AsyncIOUringSubmitStage(io, request);
+    return false;
+}
+
+static void AsyncIOUringReap(AsyncIO *io) {
+    unsigned head = *io->cqHead;
+    unsigned tail = atomic_load_explicit((_Atomic unsigned *) io->cqTail, memory_order_acquire);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &io->cqes[head & *io->cqMask];
+        AsyncIORequest *request = (AsyncIORequest *) (uintptr_t) cqe->user_data;
+        int res = cqe->res;
+        atomic_store_explicit((_Atomic unsigned *) io->cqHead, head + 1, memory_order_release);
+        if (AsyncIOUringAdvance(io, request, res)) {
+            AsyncIOListPush(&io->doneHead, &io->doneTail, request);
+        }
+    }
+}
+
+static void AsyncIOUringDestroy(AsyncIO *io) {
+    munmap(io->sqes, io->sqEntries * sizeof(struct io_uring_sqe));
+    if (io->cqRing != io->sqRing) munmap(io->cqRing, io->cqRingSize);
+    munmap(io->sqRing, io->sqRingSize);
+    close(io->ringFd);
+}
+
+#    endif // __linux__
+
+// the blocking version of a request, run by the worker threads
+static void AsyncIOTransfer(AsyncIORequest *request) {
+#    if ASYNC_IO_POSIX
+    bool reading = request->op == AsyncIORead;
+    int fd = reading ? open(request->path, O_RDONLY | O_CLOEXEC) : open(request->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        request->error = errno;
+        return;
+    }
+
+    if (reading) {
+        AsyncIOReserveRead(request, fd);
+        for (;;) {
+            if (request->buffer->capacity - request->buffer->count < 2) {
+                DynamicStringReserve(request->buffer, request->buffer->count + ASYNC_IO_READ_CHUNK + 1);
+            }
+            ssize_t res = read(fd, request->buffer->data + request->buffer->count, request->buffer->capacity - request->buffer->count - 1);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0) request->error = errno;
+            if (res <= 0) break;
+            request->buffer->count += (size_t) res;
+        }
+        request->buffer->data[request->buffer->count] = '\0';
+    } else {
+        while (request->done < request->buffer->count) {
+            ssize_t res = write(fd, request->buffer->data + request->done, request->buffer->count - request->done);
+            if (res < 0 && errno == EINTR) continue;
+            if (res < 0) {
+                request->error = errno;
+                break;
+            }
+            request->done += (size_t) res;
+        }
+    }
+    if (close(fd) != 0 && request->error == 0) request->error = errno;
+#    else
+    bool ok = request->op == AsyncIORead ? DynamicStringReadFile(request->buffer, request->path)
+                                         : DynamicStringWriteFile(request->path, request->buffer);
+    if (!ok) request->error = errno ? errno : EIO;
+#    endif // ASYNC_IO_POSIX
+}
+
+static int AsyncIOWorker(void *arg) {
+    AsyncIO *io = arg;
+    mtx_lock(&io->lock);
+    for (;;) {
+        AsyncIORequest *request = AsyncIOListPop(&io->pendingHead, &io->pendingTail);
+        if (!request) {
+            if (io->stopping) break;
+            cnd_wait(&io->submitted, &io->lock);
+            continue;
+        }
+        mtx_unlock(&io->lock);
+        AsyncIOTransfer(request);
+        mtx_lock(&io->lock);
+        AsyncIOListPush(&io->doneHead, &io->doneTail, request);
+        cnd_signal(&io->completed);
+    }
+    mtx_unlock(&io->lock);
+    return 0;
+}
+
+// entries is the io_uring queue size, workerCount the size of the thread pool used without io_uring
+bool AsyncIOInit(AsyncIO *io, unsigned entries, size_t workerCount) {
+    memset(io, 0, sizeof(*io));
+#    ifdef __linux__
+    if (ASYNC_IO_URING && AsyncIOUringInit(io, entries)) return true;
+#    else
+    (void) entries;
+#    endif // __linux__
+
+    if (workerCount == 0) workerCount = 1;
+    if (mtx_init(&io->lock, mtx_plain) != thrd_success ||
+        cnd_init(&io->submitted) != thrd_success ||
+        cnd_init(&io->completed) != thrd_success) {
+        return false;
+    }
+    io->workers = DynamicAllocatorRealloc(NULL, NULL, 0, workerCount * sizeof(*io->workers));
+    if (!io->workers) return false;
+    for (; io->workerCount < workerCount; io->workerCount++) {
+        if (thrd_create(&io->workers[io->workerCount], AsyncIOWorker, io) != thrd_success) break;
+    }
+    return io->workerCount > 0;
+}
+
+void AsyncIOSubmit(AsyncIO *io, AsyncIORequest *request) {
+    request->error = 0;
+    request->fd = -1;
+    request->stage = 0;
+    request->done = 0;
+    request->expected = 0;
+    io->inflight++;
+#    ifdef __linux__
+    if (io->uring) {
+        // the request reaches the kernel now and runs while the caller works,
+        // stages that finished since the last call are moved on and submitted with it
+        AsyncIOUringSubmitStage(io, request);
+        AsyncIOUringReap(io);
+        AsyncIOUringFlush(io, 0);
+        return;
+    }
+#    endif // __linux__
+    mtx_lock(&io->lock);
+    AsyncIOListPush(&io->pendingHead, &io->pendingTail, request);
+    cnd_signal(&io->submitted);
+    mtx_unlock(&io->lock);
+}
+
+// blocks until a request finishes and returns it, NULL when nothing is in flight
+AsyncIORequest *AsyncIOWait(AsyncIO *io) {
+    if (io->inflight == 0) return NULL;
+    AsyncIORequest *request = NULL;
+#    ifdef __linux__
+    if (io->uring) {
+        while (!(request = AsyncIOListPop(&io->doneHead, &io->doneTail))) {
+            AsyncIOUringFlush(io, 1);
+            AsyncIOUringReap(io);
+        }
+        // the next stages queued by the reap start before the caller gets back to work
+        if (io->toSubmit > 0) AsyncIOUringFlush(io, 0);
+        io->inflight--;
+        return request;
+    }
+#    endif // __linux__
+    mtx_lock(&io->lock);
+    while (!(request = AsyncIOListPop(&io->doneHead, &io->doneTail))) {
+        cnd_wait(&io->completed, &io->lock);
+    }
+    mtx_unlock(&io->lock);
+    io->inflight--;
+    return request;
+}
+
+// waits for everything still in flight
+void AsyncIODestroy(AsyncIO *io) {
+    while (AsyncIOWait(io)) {}
+#    ifdef __linux__
+    if (io->uring) {
+        AsyncIOUringDestroy(io);
+        return;
+    }
+#    endif // __linux__
+    mtx_lock(&io->lock);
+    io->stopping = true;
+    cnd_broadcast(&io->submitted);
+    mtx_unlock(&io->lock);
+    for (size_t i = 0; i < io->workerCount; i++) {
+        thrd_join(io->workers[i], NULL);
+    }
+    DynamicAllocatorFree(NULL, io->workers, io->workerCount * sizeof(*io->workers));
+    mtx_destroy(&io->lock);
+    cnd_destroy(&io->submitted);
+    cnd_destroy(&io->completed);
+}
+
+#endif // ASYNC_IO_IMPLEMENTATION
+
+#endif // _ASYNC_IO_H
\ No newline at end of file
@@ -0,0 +1,178 @@
+#ifndef _DYNAMIC_ALLOCATOR_H
+#define _DYNAMIC_ALLOCATOR_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// per-container allocation hook, a container with allocator == NULL uses DynamicDefaultAllocator
+// sizes are always passed in bytes so arena/pool allocators dont need to track them
+typedef struct DynamicAllocator {
+    void *(*reallocFunc)(void *ctx, void *ptr, size_t oldSize, size_t newSize); // NULL -> realloc()
+    void (*freeFunc)(void *ctx, void *ptr, size_t size);                        // NULL -> free()
+    void *ctx;
+
+    // instrumentation, updated by DynamicAllocatorRealloc() and DynamicAllocatorFree()
+    size_t reallocCount;
+    size_t freeCount;
+    size_t bytesRequested; // sum of what every allocation grew by, the total allocation volume
+    size_t bytesInUse;
+    size_t bytesPeak;
+} DynamicAllocator;
+
+extern DynamicAllocator DynamicDefaultAllocator;
+
+void *DynamicAllocatorRealloc(DynamicAllocator *allocator, void *ptr, size_t oldSize, size_t newSize);
+void DynamicAllocatorFree(DynamicAllocator *allocator, void *ptr, size_t size);
+void DynamicAllocatorPrintStats(const char *name, const DynamicAllocator *allocator);
+
+// bump allocator, individual frees are ignored and memory is given back by DynamicArenaReset()
+// realloc of the most recent allocation grows it in place
+typedef struct DynamicArenaBlock {
+    struct DynamicArenaBlock *prev;
+    size_t used;
+    size_t capacity;
+    char data[];
+} DynamicArenaBlock;
+
+typedef struct {
+    DynamicArenaBlock *block;
+    size_t blockSize;           // minimum capacity of a new block, 0 means DYNAMIC_ARENA_DEFAULT_SIZE
+    DynamicAllocator allocator; // hand &arena->allocator to containers, see DynamicArenaInit()
+} DynamicArena;
+
+typedef struct {
+    DynamicArenaBlock *block;
+    size_t used;
+} DynamicArenaMark;
+
+#ifndef DYNAMIC_ARENA_DEFAULT_SIZE
+#    define DYNAMIC_ARENA_DEFAULT_SIZE (4096)
+#endif // DYNAMIC_ARENA_DEFAULT_SIZE
+
+void DynamicArenaInit(DynamicArena *arena);
+DynamicArenaMark DynamicArenaGetMark(const DynamicArena *arena);
+void DynamicArenaReset(DynamicArena *arena, DynamicArenaMark mark);
+void DynamicArenaClear(DynamicArena *arena);
+void DynamicArenaDestroy(DynamicArena *arena);
+
+#ifdef DYNAMIC_ALLOCATOR_IMPLEMENTATION
+
+DynamicAllocator DynamicDefaultAllocator = {0};
+
+void *DynamicAllocatorRealloc(DynamicAllocator *allocator, void *ptr, size_t oldSize, size_t newSize) {
+    if (!allocator) allocator = &DynamicDefaultAllocator;
+
+    void *ret = allocator->reallocFunc ? allocator->reallocFunc(allocator->ctx, ptr, oldSize, newSize)
+                                       : realloc(ptr, newSize);
+    if (ret) {
+        allocator->reallocCount++;
+        if (newSize > oldSize) allocator->bytesRequested += newSize - oldSize;
+        allocator->bytesInUse = allocator->bytesInUse - oldSize + newSize;
+        if (allocator->bytesInUse > allocator->bytesPeak) {
+            allocator->bytesPeak = allocator->bytesInUse;
+        }
+    }
+    return ret;
+}
+
+void DynamicAllocatorFree(DynamicAllocator *allocator, void *ptr, size_t size) {
+    if (!ptr) return;
+    if (!allocator) allocator = &DynamicDefaultAllocator;
+
+    if (allocator->freeFunc) {
+        allocator->freeFunc(allocator->ctx, ptr, size);
+    } else {
+        free(ptr);
+    }
+    allocator->freeCount++;
+    allocator->bytesInUse -= size;
+}
+
+void DynamicAllocatorPrintStats(const char *name, const DynamicAllocator *allocator) {
+    if (!allocator) allocator = &DynamicDefaultAllocator;
+    fprintf(stderr, "%s: %zu reallocs, %zu frees, %zu bytes requested, %zu bytes in use, %zu bytes peak\n",
+            name, allocator->reallocCount, allocator->freeCount,
+            allocator->bytesRequested, allocator->bytesInUse, allocator->bytesPeak);
+}
+
+#    define DYNAMIC_ARENA_ALIGN(size) (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+static void *DynamicArenaRealloc(void *ctx, void *ptr, size_t oldSize, size_t newSize) {
+    DynamicArena *arena = ctx;
+    DynamicArenaBlock *block = arena->block;
+
+    // the last allocation of the current block can grow in place
+    if (ptr && block && (char *) ptr + DYNAMIC_ARENA_ALIGN(oldSize) == block->data + block->used &&
+        (size_t) ((char *) ptr - block->data) + DYNAMIC_ARENA_ALIGN(newSize) <= block->capacity) {
+        block->used = (size_t) ((char *) ptr - block->data) + DYNAMIC_ARENA_ALIGN(newSize);
+        return ptr;
+    }
+
+    size_t alignedSize = DYNAMIC_ARENA_ALIGN(newSize);
+    if (!block || block->capacity - block->used < alignedSize) {
+        size_t capacity = arena->blockSize ? arena->blockSize : DYNAMIC_ARENA_DEFAULT_SIZE;
+        if (block && capacity < block->capacity * 2) capacity = block->capacity * 2;
+        if (capacity < alignedSize) capacity = alignedSize;
+
+        DynamicArenaBlock *newBlock = DynamicAllocatorRealloc(NULL, NULL, 0, sizeof(DynamicArenaBlock) + capacity);
+        if (!newBlock) return NULL;
+        newBlock->prev = block;
+        newBlock->used = 0;
+        newBlock->capacity = capacity;
+        arena->block = block = newBlock;
+    }
+
+    void *ret = block->data + block->used;
+    block->used += alignedSize;
+    if (ptr) memcpy(ret, ptr, oldSize < newSize ? oldSize : newSize);
+    return ret;
+}
+
+static void DynamicArenaFree(void *ctx, void *ptr, size_t size) {
+    (void) ctx;
+    (void) ptr;
+    (void) size;
+}
+
+void DynamicArenaInit(DynamicArena *arena) {
+    arena->allocator.reallocFunc = DynamicArenaRealloc;
+    arena->allocator.freeFunc = DynamicArenaFree;
+    arena->allocator.ctx = arena;
+}
+
+DynamicArenaMark DynamicArenaGetMark(const DynamicArena *arena) {
+    return (DynamicArenaMark){
+        .block = arena->block,
+        .used = arena->block ? arena->block->used : 0,
+    };
+}
+
+// drops everything allocated after mark, containers allocated since then must not be used anymore
+void DynamicArenaReset(DynamicArena *arena, DynamicArenaMark mark) {
+    while (arena->block && arena->block != mark.block) {
+        DynamicArenaBlock *prev = arena->block->prev;
+        DynamicAllocatorFree(NULL, arena->block, sizeof(DynamicArenaBlock) + arena->block->capacity);
+        arena->block = prev;
+    }
+    if (arena->block) arena->block->used = mark.used;
+}
+
+// drops everything but keeps the oldest block, so an arena that is cleared often doesnt go back to malloc
+void DynamicArenaClear(DynamicArena *arena) {
+    while (arena->block && arena->block->prev) {
+        DynamicArenaBlock *prev = arena->block->prev;
+        DynamicAllocatorFree(NULL, arena->block, sizeof(DynamicArenaBlock) + arena->block->capacity);
+        arena->block = prev;
+    }
+    if (arena->block) arena->block->used = 0;
+}
+
+void DynamicArenaDestroy(DynamicArena *arena) {
+    DynamicArenaReset(arena, (DynamicArenaMark){0});
+}
+
+#endif // DYNAMIC_ALLOCATOR_IMPLEMENTATION
+
+#endif // _DYNAMIC_ALLOCATOR_H
\ No newline at end of file
@@ -1,21 +1,25 @@
 #ifndef _DYNAMIC_ARRAY_H
 #define _DYNAMIC_ARRAY_H
 
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "DynamicAllocator.h"
+
 #define DynamicArrayStruct(type)         \
     struct {                             \
         type *data;                      \
-        int count;                       \
-        int capacity;                    \
+        size_t count;                    \
+        size_t capacity;                 \
+        DynamicAllocator *allocator;     \
         void (*printFunc)(const type *); \
     }
 #define DynamicArraySliceStruct(type)    \
     struct {                             \
         const type *data;                \
-        const int count;                 \
+        const size_t count;              \
         void (*printFunc)(const type *); \
     }
 
@@ -34,18 +38,22 @@
 
 #ifdef DYNAMIC_ARRAY_IMPLEMENTATION
 
-#    define DynamicArrayReserve(da, size)                                               \
-        do {                                                                            \
-            if ((da)->capacity < (size)) {                                              \
-                if ((da)->capacity == 0) {                                              \
-                    (da)->capacity = DYNAMIC_ARRAY_DEFAULT_SIZE;                        \
-                }                                                                       \
-                while ((da)->capacity < (size)) {                                       \
-                    (da)->capacity *= 2;                                                \
-                }                                                                       \
-                (da)->data = realloc((da)->data, (da)->capacity * sizeof(*(da)->data)); \
-                DYNAMIC_ARRAY_ASSERT((da)->data != NULL && "Buy more RAM!!!");          \
-            }                                                                           \
+// grows to at least size elements, doubling so repeated appends stay amortized O(1)
+// but jumping straight to size when a bulk reserve asks for more than double
+#    define DynamicArrayReserve(da, size)                                                                     \
+        do {                                                                                                  \
+            size_t __dar_reqSize = (size);                                                                    \
+            if ((da)->capacity < __dar_reqSize) {                                                             \
+                size_t __dar_newCapacity = (da)->capacity == 0 ? DYNAMIC_ARRAY_DEFAULT_SIZE                   \
+                                                               : (da)->capacity * 2;                          \
+                if (__dar_newCapacity < __dar_reqSize) __dar_newCapacity = __dar_reqSize;                     \
+                DYNAMIC_ARRAY_ASSERT(__dar_newCapacity <= SIZE_MAX / sizeof(*(da)->data) && "Size overflow"); \
+                (da)->data = DynamicAllocatorRealloc((da)->allocator, (da)->data,                             \
+                                                     (da)->capacity * sizeof(*(da)->data),                    \
+                                                     __dar_newCapacity * sizeof(*(da)->data));                \
+                DYNAMIC_ARRAY_ASSERT((da)->data != NULL && "Buy more RAM!!!");                                \
+                (da)->capacity = __dar_newCapacity;                                                           \
+            }                                                                                                 \
         } while (0)
 
 #    define DynamicArrayAppend(da, x)                   \
@@ -54,16 +62,25 @@
             (da)->data[(da)->count++] = (x);            \
         } while (0)
 
-#    define DynamicArrayRemoveAt(da, i)                                                                   \
-        do {                                                                                              \
-            if ((da)->data) {                                                                             \
-                if ((i) >= 0 && (i) < (da)->count) {                                                      \
-                    for (int __dara_shiftIdx = i; __dara_shiftIdx < (da)->count - 1; __dara_shiftIdx++) { \
-                        (da)->data[__dara_shiftIdx] = (da)->data[__dara_shiftIdx + 1];                    \
-                    }                                                                                     \
-                    (da)->count--;                                                                        \
-                }                                                                                         \
-            }                                                                                             \
+// appends n elements from items with a single reserve and memcpy
+#    define DynamicArrayAppendMany(da, items, n)                                          \
+        do {                                                                              \
+            size_t __dam_n = (n);                                                         \
+            if (__dam_n > 0) {                                                            \
+                DynamicArrayReserve((da), (da)->count + __dam_n);                         \
+                memcpy((da)->data + (da)->count, (items), __dam_n * sizeof(*(da)->data)); \
+                (da)->count += __dam_n;                                                   \
+            }                                                                             \
+        } while (0)
+
+#    define DynamicArrayRemoveAt(da, i)                                        \
+        do {                                                                   \
+            size_t __dara_idx = (i);                                           \
+            if ((da)->data && __dara_idx < (da)->count) {                      \
+                memmove((da)->data + __dara_idx, (da)->data + __dara_idx + 1,  \
+                        ((da)->count - __dara_idx - 1) * sizeof(*(da)->data)); \
+                (da)->count--;                                                 \
+            }                                                                  \
         } while (0)
 
 #    define DynamicArrayIsEmpty(da) ((da)->count == 0)
@@ -95,10 +112,13 @@
             (da)->count = 0;      \
         } while (0)
 
-#    define DynamicArrayDestroy(da)         \
-        do {                                \
-            free((da)->data);               \
-            memset((da), 0, sizeof(*(da))); \
+// keeps the allocator so the array can be reused with it
+#    define DynamicArrayDestroy(da)                                                                  \
+        do {                                                                                         \
+            DynamicAllocator *__dad_allocator = (da)->allocator;                                     \
+            DynamicAllocatorFree(__dad_allocator, (da)->data, (da)->capacity * sizeof(*(da)->data)); \
+            memset((da), 0, sizeof(*(da)));                                                          \
+            (da)->allocator = __dad_allocator;                                                       \
         } while (0)
 
 #    define DynamicArrayForeach(type, var, da) for (type *var = (da)->data; var < (da)->data + (da)->count; var++)
@@ -113,7 +133,7 @@
             .count = (end_idx) - (start_idx) + 1,     \
             .printFunc = (da)->printFunc,             \
         };                                            \
-        DYNAMIC_ARRAY_ASSERT("Slice out of bounds" && 0 <= (start_idx) && (start_idx) <= (end_idx) && (end_idx) < (da)->count)
+        DYNAMIC_ARRAY_ASSERT("Slice out of bounds" && (start_idx) <= (end_idx) && (end_idx) < (da)->count)
 
 #endif // DYNAMIC_ARRAY_IMPLEMENTATION
 
@@ -2,15 +2,20 @@
 #define _DYNAMIC_STRING_H
 
 #include <assert.h>
+#include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "DynamicAllocator.h"
+
 typedef struct {
     char *data;
     size_t count; // count == strlen(data)
     size_t capacity;
+    DynamicAllocator *allocator;
 } DynamicString;
 
 void DynamicStringRemoveAll(DynamicString *ds, char x);
@@ -26,19 +31,20 @@ bool DynamicStringWriteFile(const char *filePath, DynamicString *ds);
 
 #ifdef DYNAMIC_STRING_IMPLEMENTATION
 
-#    define DynamicStringReserve(ds, size)                        \
-        do {                                                      \
-            size_t __dsr_reqSize = (size);                        \
-            if ((ds)->capacity < __dsr_reqSize) {                 \
-                if ((ds)->capacity == 0) {                        \
-                    (ds)->capacity = DYNAMIC_STRING_DEFAULT_SIZE; \
-                }                                                 \
-                while ((ds)->capacity < __dsr_reqSize) {          \
-                    (ds)->capacity *= 2;                          \
-                }                                                 \
-                (ds)->data = realloc((ds)->data, (ds)->capacity); \
-                assert(((ds)->data != NULL) && "REALLOC FAIL");   \
-            }                                                     \
+// same growth rule as DynamicArrayReserve
+#    define DynamicStringReserve(ds, size)                                                   \
+        do {                                                                                 \
+            size_t __dsr_reqSize = (size);                                                   \
+            if ((ds)->capacity < __dsr_reqSize) {                                            \
+                assert(((ds)->capacity <= SIZE_MAX / 2) && "Size overflow");                 \
+                size_t __dsr_newCapacity = (ds)->capacity == 0 ? DYNAMIC_STRING_DEFAULT_SIZE \
+                                                               : (ds)->capacity * 2;         \
+                if (__dsr_newCapacity < __dsr_reqSize) __dsr_newCapacity = __dsr_reqSize;    \
+                (ds)->data = DynamicAllocatorRealloc((ds)->allocator, (ds)->data,            \
+                                                     (ds)->capacity, __dsr_newCapacity);     \
+                assert(((ds)->data != NULL) && "REALLOC FAIL");                              \
+                (ds)->capacity = __dsr_newCapacity;                                          \
+            }                                                                                \
         } while (0)
 
 #    define DynamicStringAppendf(ds, fstr, ...)                                                    \
@@ -89,12 +95,15 @@ bool DynamicStringWriteFile(const char *filePath, DynamicString *ds);
             }                                                    \
         } while (0)
 
-#    define DynamicStringDestroy(ds)            \
-        do {                                    \
-            if ((ds)->data) {                   \
-                free((ds)->data);               \
-                memset((ds), 0, sizeof(*(ds))); \
-            }                                   \
+// keeps the allocator so the string can be reused with it
+#    define DynamicStringDestroy(ds)                                               \
+        do {                                                                       \
+            if ((ds)->data) {                                                      \
+                DynamicAllocator *__dsd_allocator = (ds)->allocator;               \
+                DynamicAllocatorFree(__dsd_allocator, (ds)->data, (ds)->capacity); \
+                memset((ds), 0, sizeof(*(ds)));                                    \
+                (ds)->allocator = __dsd_allocator;                                 \
+            }                                                                      \
         } while (0)
 
 bool DynamicStringReadFile(DynamicString *ds, const char *filePath) {
@@ -123,13 +132,14 @@ bool DynamicStringReadFile(DynamicString *ds, const char *filePath) {
         ret = false;
         goto finish;
     }
-    DynamicStringReserve(ds, fileLen);
-    if (fread(ds->data, 1, fileLen, inputFile) != (size_t) fileLen) {
+    DynamicStringReserve(ds, ds->count + fileLen + 1);
+    if (fread(ds->data + ds->count, 1, fileLen, inputFile) != (size_t) fileLen) {
         fprintf(stderr, "Could not fread \"%s\" to dynamic string: %s", filePath, strerror(errno));
         ret = false;
         goto finish;
     }
     ds->count += fileLen;
+    ds->data[ds->count] = '\0';
 
 finish:
     if (inputFile) {
@@ -148,7 +158,8 @@ bool DynamicStringWriteFile(const char *filePath, DynamicString *ds) {
         ret = false;
         goto finish;
     }
-    if (fwrite(ds->data, 1, ds->count, outputFile) != ds->count) {
+    // an empty string has no data yet, fwrite() must not get NULL even for 0 bytes
+    if (ds->count > 0 && fwrite(ds->data, 1, ds->count, outputFile) != ds->count) {
         fprintf(stderr, "Could not fwrite dynamic string to \"%s\": %s", filePath, strerror(errno));
         ret = false;
         goto finish;
@@ -0,0 +1,290 @@
+#ifndef _OUTPUT_CACHE_H
+#define _OUTPUT_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "DynamicString.h"
+
+// content-addressed cache of output files, an entry is named after the key of everything that produced it
+// entries are written to a temporary file and renamed into place, so concurrent writers and readers
+// only ever see complete entries, and they are read-only so nothing writes to them by accident
+// outputs are reflinks or copies, never hardlinks, since any later write to an output would change its entry
+typedef struct {
+    uint64_t hash[2];
+} CacheKey;
+
+#define CACHE_KEY_HEX_LEN (32)
+
+void CacheKeyInit(CacheKey *key);
+void CacheKeyAdd(CacheKey *key, const void *data, size_t len);
+void CacheKeyAddString(CacheKey *key, const char *str);
+uint64_t CacheHash(const void *data, size_t len, uint64_t seed);
+
+bool OutputCacheLookup(const char *cacheDir, CacheKey key, char *entryPath, size_t entryPathSize);
+bool OutputCachePlace(const char *entryPath, const char *outputPath);
+bool OutputCacheStore(const char *cacheDir, CacheKey key, const DynamicString *output);
+bool OutputCacheStoreFile(const char *cacheDir, CacheKey key, const char *filePath);
+
+#ifdef OUTPUT_CACHE_IMPLEMENTATION
+
+#    ifdef _WIN32
+#        include <direct.h>
+#        include <windows.h>
+#    else
+#        include <fcntl.h>
+#        include <sys/stat.h>
+#        include <unistd.h>
+#        ifdef __linux__
+#            include <linux/fs.h>
+#            include <sys/ioctl.h>
+#        endif // __linux__
+#    endif // _WIN32
+
+// XXH64
+#    define CACHE_HASH_P1 (11400714785074694791ULL)
+#    define CACHE_HASH_P2 (14029467366897019727ULL)
+#    define CACHE_HASH_P3 (1609587929392839161ULL)
+#    define CACHE_HASH_P4 (9650029242287828579ULL)
+#    define CACHE_HASH_P5 (2870177450012600261ULL)
+
+static uint64_t CacheHashRotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t CacheHashRead64(const unsigned char *p) {
+    uint64_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint32_t CacheHashRead32(const unsigned char *p) {
+    uint32_t x;
+    memcpy(&x, p, sizeof(x));
+    return x;
+}
+
+static uint64_t CacheHashRound(uint64_t acc, uint64_t input) {
+    acc += input * CACHE_HASH_P2;
+    acc = CacheHashRotl(acc, 31);
+    return acc * CACHE_HASH_P1;
+}
+
+static uint64_t CacheHashMerge(uint64_t acc, uint64_t val) {
+    acc ^= CacheHashRound(0, val);
+    return acc * CACHE_HASH_P1 + CACHE_HASH_P4;
+}
+
+uint64_t CacheHash(const void *data, size_t len, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + len;
+    uint64_t h;
+
+    if (len >= 32) {
+        uint64_t v1 = seed + CACHE_HASH_P1 + CACHE_HASH_P2;
+        uint64_t v2 = seed + CACHE_HASH_P2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - CACHE_HASH_P1;
+        do {
+            v1 = CacheHashRound(v1, CacheHashRead64(p));
+            v2 = CacheHashRound(v2, CacheHashRead64(p + 8));
+            v3 = CacheHashRound(v3, CacheHashRead64(p + 16));
+            v4 = CacheHashRound(v4, CacheHashRead64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+        h = CacheHashRotl(v1, 1) + CacheHashRotl(v2, 7) + CacheHashRotl(v3, 12) + CacheHashRotl(v4, 18);
+        h = CacheHashMerge(h, v1);
+        h = CacheHashMerge(h, v2);
+        h = CacheHashMerge(h, v3);
+        h = CacheHashMerge(h, v4);
+    } else {
+        h = seed + CACHE_HASH_P5;
+    }
+    h += len;
+
+    for (; end - p >= 8; p += 8) {
+        h ^= CacheHashRound(0, CacheHashRead64(p));
+        h = CacheHashRotl(h, 27) * CACHE_HASH_P1 + CACHE_HASH_P4;
+    }
+    if (end - p >= 4) {
+        h ^= (uint64_t) CacheHashRead32(p) * CACHE_HASH_P1;
+        h = CacheHashRotl(h, 23) * CACHE_HASH_P2 + CACHE_HASH_P3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        h ^= *p * CACHE_HASH_P5;
+        h = CacheHashRotl(h, 11) * CACHE_HASH_P1;
+    }
+
+    h ^= h >> 33;
+    h *= CACHE_HASH_P2;
+    h ^= h >> 29;
+    h *= CACHE_HASH_P3;
+    h ^= h >> 32;
+    return h;
+}
+
+void CacheKeyInit(CacheKey *key) {
+    key->hash[0] = 0;
+    key->hash[1] = CACHE_HASH_P5;
+}
+
+// every part is chained through the seed together with its length, so where one part ends matters
+void CacheKeyAdd(CacheKey *key, const void *data, size_t len) {
+    key->hash[0] = CacheHash(data, len, key->hash[0] ^ len);
+    key->hash[1] = CacheHash(data, len, key->hash[1] + len);
+}
+
+void CacheKeyAddString(CacheKey *key, const char *str) {
+    CacheKeyAdd(key, str, strlen(str));
+}
+
+static bool OutputCacheEntryPath(const char *cacheDir, CacheKey key, const char *suffix, char *path, size_t pathSize) {
+    int len = snprintf(path, pathSize, "%s/%016llx%016llx%s", cacheDir,
+                       (unsigned long long) key.hash[0], (unsigned long long) key.hash[1], suffix);
+    return len > 0 && (size_t) len < pathSize;
+}
+
+// unique per process and call, so concurrent workers never write the same temporary file
+static void OutputCacheTempSuffix(char *suffix, size_t suffixSize) {
+    static unsigned long counter = 0;
+#    ifdef _WIN32
+    unsigned long pid = (unsigned long) GetCurrentProcessId();
+#    else
+    unsigned long pid = (unsigned long) getpid();
+#    endif // _WIN32
+    snprintf(suffix, suffixSize, ".tmp.%lu.%lu", pid, counter++);
+}
+
+static bool OutputCacheTempPath(const char *cacheDir, CacheKey key, char *path, size_t pathSize) {
+    char suffix[64];
+    OutputCacheTempSuffix(suffix, sizeof(suffix));
+    return OutputCacheEntryPath(cacheDir, key, suffix, path, pathSize);
+}
+
+// replaces whatever is at toPath in one step
+static bool OutputCacheRename(const char *fromPath, const char *toPath) {
+#    ifdef _WIN32
+    return MoveFileExA(fromPath, toPath, MOVEFILE_REPLACE_EXISTING);
+#    else
+    return rename(fromPath, toPath) == 0;
+#    endif // _WIN32
+}
+
+static bool OutputCacheMakeDir(const char *cacheDir) {
+#    ifdef _WIN32
+    if (_mkdir(cacheDir) == 0 || errno == EEXIST) return true;
+#    else
+    if (mkdir(cacheDir, 0777) == 0 || errno == EEXIST) return true;
+#    endif // _WIN32
+    fprintf(stderr, "Could not create cache directory \"%s\": %s\n", cacheDir, strerror(errno));
+    return false;
+}
+
+// makes the entry read-only and moves it into place, replacing an identical entry from a concurrent writer
+static bool OutputCachePublish(const char *tempPath, const char *entryPath) {
+#    ifdef _WIN32
+    SetFileAttributesA(tempPath, FILE_ATTRIBUTE_READONLY);
+#    else
+    chmod(tempPath, 0444);
+#    endif // _WIN32
+    if (OutputCacheRename(tempPath, entryPath)) return true;
+    fprintf(stderr, "Could not move cache entry to \"%s\": %s\n", entryPath, strerror(errno));
+    remove(tempPath);
+    return false;
+}
+
+// copy on write clone of the whole file, only where the filesystem supports it
+static bool OutputCacheReflink(const char *srcPath, const char *dstPath) {
+#    if defined(__linux__) && defined(FICLONE)
+    bool ret = false;
+    int src = open(srcPath, O_RDONLY);
+    int dst = open(dstPath, O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (src >= 0 && dst >= 0) ret = ioctl(dst, FICLONE, src) == 0;
+    if (src >= 0) close(src);
+    if (dst >= 0) {
+        close(dst);
+        if (!ret) remove(dstPath);
+    }
+    return ret;
+#    else
+    (void) srcPath;
+    (void) dstPath;
+    return false;
+#    endif // __linux__ && FICLONE
+}
+
+static bool OutputCacheCopy(const char *srcPath, const char *dstPath) {
+    DynamicString content = {0};
+    bool ret = DynamicStringReadFile(&content, srcPath) && DynamicStringWriteFile(dstPath, &content);
+    DynamicStringDestroy(&content);
+    return ret;
+}
+
+// entryPath receives the path of the entry when it exists
+bool OutputCacheLookup(const char *cacheDir, CacheKey key, char *entryPath, size_t entryPathSize) {
+    if (!OutputCacheEntryPath(cacheDir, key, "", entryPath, entryPathSize)) return false;
+    FILE *entry = fopen(entryPath, "rb");
+    if (!entry) return false;
+    fclose(entry);
+    return true;
+}
+
+// puts a cache entry at outputPath without going through memory when possible: reflink, then copy
+// it is placed next to outputPath and renamed over it, so when placing fails the old output is still there
+bool OutputCachePlace(const char *entryPath, const char *outputPath) {
+    char tempPath[4096], suffix[64];
+    OutputCacheTempSuffix(suffix, sizeof(suffix));
+    int len = snprintf(tempPath, sizeof(tempPath), "%s%s", outputPath, suffix);
+    if (len <= 0 || (size_t) len >= sizeof(tempPath)) {
+        fprintf(stderr, "Output path is too long: \"%s\"\n", outputPath);
+        return false;
+    }
+
+    if (!OutputCacheReflink(entryPath, tempPath) && !OutputCacheCopy(entryPath, tempPath)) {
+        remove(tempPath);
+        return false;
+    }
+    if (OutputCacheRename(tempPath, outputPath)) return true;
+    fprintf(stderr, "Could not move the output to \"%s\": %s\n", outputPath, strerror(errno));
+    remove(tempPath);
+    return false;
+}
+
+bool OutputCacheStore(const char *cacheDir, CacheKey key, const DynamicString *output) {
+    char tempPath[4096], entryPath[4096];
+    if (!OutputCacheMakeDir(cacheDir)) return false;
+    if (!OutputCacheTempPath(cacheDir, key, tempPath, sizeof(tempPath)) ||
+        !OutputCacheEntryPath(cacheDir, key, "", entryPath, sizeof(entryPath))) {
+        fprintf(stderr, "Cache directory path is too long: \"%s\"\n", cacheDir);
+        return false;
+    }
+
+    if (!DynamicStringWriteFile(tempPath, (DynamicString *) output)) {
+        remove(tempPath);
+        return false;
+    }
+    return OutputCachePublish(tempPath, entryPath);
+}
+
+bool OutputCacheStoreFile(const char *cacheDir, CacheKey key, const char *filePath) {
+    char tempPath[4096], entryPath[4096];
+    if (!OutputCacheMakeDir(cacheDir)) return false;
+    if (!OutputCacheTempPath(cacheDir, key, tempPath, sizeof(tempPath)) ||
+        !OutputCacheEntryPath(cacheDir, key, "", entryPath, sizeof(entryPath))) {
+        fprintf(stderr, "Cache directory path is too long: \"%s\"\n", cacheDir);
+        return false;
+    }
+
+    if (!OutputCacheReflink(filePath, tempPath) && !OutputCacheCopy(filePath, tempPath)) {
+        remove(tempPath);
+        return false;
+    }
+    return OutputCachePublish(tempPath, entryPath);
+}
+
+#endif // OUTPUT_CACHE_IMPLEMENTATION
+
+#endif // _OUTPUT_CACHE_H
\ No newline at end of file
@@ -0,0 +1,73 @@
+#ifndef _SPSC_RING_H
+#define _SPSC_RING_H
+
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "DynamicAllocator.h"
+
+#ifndef SPSC_RING_CACHE_LINE
+#    define SPSC_RING_CACHE_LINE (64)
+#endif // SPSC_RING_CACHE_LINE
+
+// lock-free ring of pointers for exactly one producer thread and one consumer thread
+// head and tail live on separate cache lines so the two threads dont fight over them
+typedef struct {
+    void **slots;
+    size_t capacity; // power of 2
+    alignas(SPSC_RING_CACHE_LINE) atomic_size_t head; // next slot to pop, written only by the consumer
+    alignas(SPSC_RING_CACHE_LINE) atomic_size_t tail; // next slot to push, written only by the producer
+} SpscRing;
+
+bool SpscRingInit(SpscRing *ring, size_t capacity);
+void SpscRingDestroy(SpscRing *ring);
+bool SpscRingTryPush(SpscRing *ring, void *item);
+bool SpscRingTryPop(SpscRing *ring, void **item);
+
+#ifdef SPSC_RING_IMPLEMENTATION
+
+bool SpscRingInit(SpscRing *ring, size_t capacity) {
+    size_t roundedCapacity = 1;
+    while (roundedCapacity < capacity) roundedCapacity *= 2;
+
+    ring->slots = DynamicAllocatorRealloc(NULL, NULL, 0, roundedCapacity * sizeof(*ring->slots));
+    if (!ring->slots) return false;
+    ring->capacity = roundedCapacity;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return true;
+}
+
+void SpscRingDestroy(SpscRing *ring) {
+    DynamicAllocatorFree(NULL, ring->slots, ring->capacity * sizeof(*ring->slots));
+    ring->slots = NULL;
+    ring->capacity = 0;
+}
+
+// producer only, false when the ring is full
+bool SpscRingTryPush(SpscRing *ring, void *item) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    if (tail - head == ring->capacity) return false;
+
+    ring->slots[tail & (ring->capacity - 1)] = item;
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+// consumer only, false when the ring is empty
+bool SpscRingTryPop(SpscRing *ring, void **item) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head == tail) return false;
+
+    *item = ring->slots[head & (ring->capacity - 1)];
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+    return true;
+}
+
+#endif // SPSC_RING_IMPLEMENTATION
+
+#endif // _SPSC_RING_H
\ No newline at end of file
@@ -1,6 +1,14 @@
+#if defined(MACROLANG_BATCH) && !defined(_GNU_SOURCE)
+#    define _GNU_SOURCE // the io_uring backend of AsyncIO.h needs syscall(), MAP_POPULATE, AT_FDCWD and O_CLOEXEC even with -std=c11
+#endif // MACROLANG_BATCH && !_GNU_SOURCE
+
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 
+#define DYNAMIC_ALLOCATOR_IMPLEMENTATION
+#include "DynamicAllocator.h"
+
 #define DYNAMIC_STRING_IMPLEMENTATION
 #include "DynamicString.h"
 
@@ -8,10 +16,30 @@
 #define DYNAMIC_ARRAY_IMPLEMENTATION
 #include "DynamicArray.h"
 
+#define OUTPUT_CACHE_IMPLEMENTATION
+#include "OutputCache.h"
+
+#ifdef MACROLANG_PIPELINE // lex, expand and write on separate threads
+#    include <threads.h>
+
+#    define SPSC_RING_IMPLEMENTATION
+#    include "SpscRing.h"
+#endif // MACROLANG_PIPELINE
+
+#ifdef MACROLANG_BATCH // expand many files per run with their reads and writes in the background
+#    define ASYNC_IO_IMPLEMENTATION
+#    include "AsyncIO.h"
+#endif // MACROLANG_BATCH
+
 // #define CONSTANT_STRING_IMPLEMENTATION
 // #include "ConstantString.h"
 
-#define DEBUG_PRINTING
+// the pipeline streams the output to stdout as it is produced, the debug printing would be mixed into it
+#if !defined(MACROLANG_QUIET) && !defined(MACROLANG_PIPELINE) // MACROLANG_QUIET turns it off for timing and scripts
+#    define DEBUG_PRINTING
+#endif // !MACROLANG_QUIET && !MACROLANG_PIPELINE
+
+#define MACROLANG_VERSION "0.2.0" // part of the output cache key, bump it when the output of the same input changes
 
 #define UNREACHABLE(msg)                              \
     do {                                              \
@@ -25,16 +53,20 @@
 
 #define ARRAY_LEN(arr) (sizeof((arr)) / sizeof(*(arr)))
 
+// the default syntax, every input can change it, see MacroSyntax
 #define MACRO_KEYWORD_PREFIX ('#')
 #define MACRO_ARGS_START ('(')
 #define MACRO_ARGS_SEPARATOR (',')
 #define MACRO_ARGS_END (')')
+#define MACRO_VARIADIC_SYMBOL ('.') // written 3 times after the last parameter
 
 typedef struct {
     const char *data;
     size_t data_len; // the strlen() of data
     size_t current;
     size_t current_line;
+    const struct MacroSyntax *syntax;
+    struct MacroPipeline *pipeline; // when set tokens come from the lexer thread instead of data
 } Lexer;
 
 #define LexerCurrent(l) ((l)->data[(l)->current])
@@ -52,7 +84,14 @@ LexerMark GetMark(Lexer *lexer) {
     };
 }
 
+#ifdef MACROLANG_PIPELINE
+void PipelineSetMark(Lexer *lexer, LexerMark mark);
+#endif // MACROLANG_PIPELINE
+
 void SetMark(Lexer *lexer, LexerMark mark) {
+#ifdef MACROLANG_PIPELINE
+    if (lexer->pipeline) PipelineSetMark(lexer, mark);
+#endif // MACROLANG_PIPELINE
     lexer->current = mark.current;
     lexer->current_line = mark.current_line;
 }
@@ -66,10 +105,18 @@ typedef enum {
     TokenSymbol,
     TokenNumber,
     TokenMacroKeyword,
+    TokenPushKeyword,
+    TokenPopKeyword,
+    TokenUndefKeyword,
+    TokenCountKeyword,
+    TokenAtKeyword,
+    TokenEachKeyword,
+    TokenSyntaxKeyword,
 } TokenType;
 
 typedef struct {
     TokenType type;
+    uint32_t closeOffset; // for an args start: tokens until its matching args end, 0 when unknown
     const char *data;
     size_t data_len; // the strlen() of data
 } Token;
@@ -79,15 +126,64 @@ typedef struct {
 
 DynamicArrayDef(Tokens, Token);
 
+// a view into tokens owned by someone else, used to pass arguments around without copying them
+typedef struct {
+    const Token *data;
+    size_t count;
+} TokenSpan;
+
+DynamicArrayDef(TokenSpans, TokenSpan);
+
 #define MACRO_KEYWORD(name, t) \
     { .data = name, .data_len = sizeof(name) - 1, .type = t }
 
 Token MacroKeywords[] = {
     MACRO_KEYWORD("macro", TokenMacroKeyword),
+    MACRO_KEYWORD("push", TokenPushKeyword),
+    MACRO_KEYWORD("pop", TokenPopKeyword),
+    MACRO_KEYWORD("undef", TokenUndefKeyword),
+    MACRO_KEYWORD("count", TokenCountKeyword),
+    MACRO_KEYWORD("at", TokenAtKeyword),
+    MACRO_KEYWORD("each", TokenEachKeyword),
+    MACRO_KEYWORD("syntax", TokenSyntaxKeyword),
 };
 
 #undef MACRO_KEYWORD
 
+typedef enum {
+    CharNone,
+    CharNewline,
+    CharSpace,
+    CharSymbol,
+    CharText,
+    CharNumber,
+    CharKeywordPrefix,
+} CharClass;
+
+#ifndef MACRO_SYNTAX_MAX_KEYWORD_BITS
+#    define MACRO_SYNTAX_MAX_KEYWORD_BITS (8) // log2 of the biggest keyword hash table
+#endif // MACRO_SYNTAX_MAX_KEYWORD_BITS
+#ifndef MACRO_SYNTAX_SEED_ATTEMPTS
+#    define MACRO_SYNTAX_SEED_ATTEMPTS (1024) // seeds tried per table size
+#endif // MACRO_SYNTAX_SEED_ATTEMPTS
+
+// the delimiters and keyword names of an input, MacroSyntaxBuild() turns them into the tables the lexer uses
+// so a custom syntax costs the same per character as the default one
+typedef struct MacroSyntax {
+    char keywordPrefix;
+    char argsStart;
+    char argsSeparator;
+    char argsEnd;
+    char variadicSymbol;
+    Token keywords[ARRAY_LEN(MacroKeywords)]; // same order and types as MacroKeywords, only the names change
+
+    // built by MacroSyntaxBuild()
+    unsigned char charClass[256];
+    uint32_t keywordSeed;
+    unsigned keywordShift;                                          // 32 - log2 of the slot count
+    unsigned char keywordSlots[1 << MACRO_SYNTAX_MAX_KEYWORD_BITS]; // index + 1 into keywords, 0 == empty
+} MacroSyntax;
+
 const char *TokenTypeName(TokenType t) {
     switch (t) {
         case TokenEnd: return "End";
@@ -98,6 +194,13 @@ const char *TokenTypeName(TokenType t) {
         case TokenSymbol: return "Symbol";
         case TokenNumber: return "Number";
         case TokenMacroKeyword: return "Macro Keyword";
+        case TokenPushKeyword: return "Push Keyword";
+        case TokenPopKeyword: return "Pop Keyword";
+        case TokenUndefKeyword: return "Undef Keyword";
+        case TokenCountKeyword: return "Count Keyword";
+        case TokenAtKeyword: return "At Keyword";
+        case TokenEachKeyword: return "Each Keyword";
+        case TokenSyntaxKeyword: return "Syntax Keyword";
         default: UNREACHABLE("Unknown TokenType");
     }
 }
@@ -105,15 +208,71 @@ const char *TokenTypeName(TokenType t) {
 typedef enum {
     MacroValue,
     MacroArgs,
+    MacroUndefined, // left by #undef, hides older definitions of the same name
 } MacroType;
 
+// what MacroDefine worked out about one token of a macro value, so expanding never searches for it again
+typedef struct {
+    int argIdx;        // the parameter this token names, 1 based, 0 for none
+    size_t usesBefore; // value tokens before this one that name a parameter or are an operator
+} MacroValueRef;
+
+DynamicArrayDef(MacroValueRefs, MacroValueRef);
+
 typedef struct {
     MacroType type;
+    bool variadic; // the last parameter takes every remaining argument
     Tokens key;
     Tokens value;
+    MacroValueRefs refs; // MacroArgs only, one per value token and one past the end
+    size_t activeCount; // frames in the current expansion context that are activations of this macro
+    size_t hash; // hash of the macro name
+    size_t next; // index + 1 of the next older macro in the same bucket, 0 ends the chain
 } Macro;
 
 DynamicArrayDef(Macros, Macro);
+DynamicArrayDef(MacroBuckets, size_t);
+
+typedef struct {
+    size_t macroCount;
+    DynamicArenaMark arenaMark;
+} MacroScope;
+
+DynamicArrayDef(MacroScopes, MacroScope);
+
+// every definition is kept in macros in definition order and the buckets chain them newest first,
+// so a lookup finds the innermost definition and popping a scope only unlinks the tail of macros
+typedef struct {
+    Macros macros;
+    MacroBuckets buckets; // index + 1 into macros, 0 == empty, count is a power of 2
+    MacroScopes scopes;
+    DynamicArena arena; // key and value tokens of every macro, reset when a scope is popped
+} MacroTable;
+
+struct MacroFrame;
+
+// a span bound to a parameter, it is expanded in the context it was written in
+// which stays the same when it is forwarded from macro to macro
+typedef struct {
+    TokenSpan span;
+    const struct MacroFrame *context; // the active chain at the call site the span comes from
+} MacroBinding;
+
+DynamicArrayDef(MacroBindings, MacroBinding);
+
+// one activation of a macro, args are the spans bound to its parameters in order
+// the last parameter of a variadic macro is bound to every span from its index on
+typedef struct MacroFrame {
+    Macro *macro;
+    const MacroBinding *args;
+    size_t argCount;
+    const struct MacroFrame *parent; // the activation being expanded when this one was called
+    size_t depth;                    // frames in the chain ending at this one
+} MacroFrame;
+
+#ifndef MACRO_TABLE_DEFAULT_BUCKETS
+#    define MACRO_TABLE_DEFAULT_BUCKETS (64)
+#endif // MACRO_TABLE_DEFAULT_BUCKETS
 
 void printMacro(const Macro *macro) {
     printf("( KEY: ");
@@ -125,10 +284,22 @@ void printMacro(const Macro *macro) {
     printf(")");
 }
 
-Macros DefinedMacros = {
-    .printFunc = printMacro,
+MacroTable DefinedMacros = {
+    .macros = {.printFunc = printMacro},
 };
 
+// argument lists and generated tokens of the current top level expansion
+DynamicArena ExpansionArena = {0};
+
+#ifndef MACRO_MAX_EXPANSION_DEPTH
+#    define MACRO_MAX_EXPANSION_DEPTH (1024)
+#endif // MACRO_MAX_EXPANSION_DEPTH
+
+size_t ExpansionDepth = 0; // macro invocations in progress, see MacroExpandFrame()
+
+// the active chain the activeCount of every macro is counted for, see MacroSwitchContext()
+const MacroFrame *ExpansionContext = NULL;
+
 bool is_number(char c) {
     return ('0' <= c && c <= '9');
 }
@@ -151,6 +322,152 @@ bool cmpToken(const Token *a, const Token *b) {
     return (a->data_len == b->data_len) && (strncmp(a->data, b->data, a->data_len) == 0);
 }
 
+void MacroSyntaxInit(MacroSyntax *syntax) {
+    *syntax = (MacroSyntax){
+        .keywordPrefix = MACRO_KEYWORD_PREFIX,
+        .argsStart = MACRO_ARGS_START,
+        .argsSeparator = MACRO_ARGS_SEPARATOR,
+        .argsEnd = MACRO_ARGS_END,
+        .variadicSymbol = MACRO_VARIADIC_SYMBOL,
+    };
+    memcpy(syntax->keywords, MacroKeywords, sizeof(MacroKeywords));
+}
+
+// the name a keyword has in this syntax, for error messages
+const Token *MacroSyntaxKeyword(const MacroSyntax *syntax, TokenType type) {
+    for (size_t i = 0; i < ARRAY_LEN(syntax->keywords); i++) {
+        if (syntax->keywords[i].type == type) return &syntax->keywords[i];
+    }
+    UNREACHABLE("Unknown keyword");
+}
+
+// FNV-1a from the seed, the top bits of a multiplicative hash pick the slot
+uint32_t MacroSyntaxKeywordSlot(const MacroSyntax *syntax, const char *data, size_t len) {
+    uint32_t hash = syntax->keywordSeed;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char) data[i];
+        hash *= 16777619u;
+    }
+    return (hash * 2654435769u) >> syntax->keywordShift;
+}
+
+// validates the syntax and builds its character classes and a collision free keyword table
+bool MacroSyntaxBuild(MacroSyntax *syntax) {
+    const char delimiters[] = {syntax->keywordPrefix, syntax->argsStart, syntax->argsSeparator, syntax->argsEnd, syntax->variadicSymbol};
+    for (size_t i = 0; i < ARRAY_LEN(delimiters); i++) {
+        if (!is_symbol(delimiters[i])) {
+            fprintf(stderr, "Invalid syntax: '%c' is not an ascii symbol\n", delimiters[i]);
+            return false;
+        }
+        for (size_t j = 0; j < i; j++) {
+            if (delimiters[i] == delimiters[j]) {
+                fprintf(stderr, "Invalid syntax: '%c' is used twice\n", delimiters[i]);
+                return false;
+            }
+        }
+    }
+    // a keyword has to be lexed as a single text token
+    for (size_t i = 0; i < ARRAY_LEN(syntax->keywords); i++) {
+        const Token *keyword = &syntax->keywords[i];
+        bool valid = keyword->data_len > 0 && is_text(keyword->data[0]);
+        for (size_t j = 1; valid && j < keyword->data_len; j++) {
+            valid = is_text(keyword->data[j]) || is_number(keyword->data[j]);
+        }
+        for (size_t j = 0; valid && j < i; j++) {
+            valid = !cmpToken(keyword, &syntax->keywords[j]);
+        }
+        if (!valid) {
+            fprintf(stderr, "Invalid syntax: \"" Token_Fmt "\" can not be a keyword\n", Token_Arg(keyword));
+            return false;
+        }
+    }
+
+    for (int c = 0; c < 256; c++) {
+        CharClass class = CharNone;
+        if (c == '\n') {
+            class = CharNewline;
+        } else if (is_space((char) c)) {
+            class = CharSpace;
+        } else if (is_symbol((char) c)) {
+            class = CharSymbol;
+        } else if (is_text((char) c)) {
+            class = CharText;
+        } else if (is_number((char) c)) {
+            class = CharNumber;
+        }
+        syntax->charClass[c] = (unsigned char) class;
+    }
+    syntax->charClass[(unsigned char) syntax->keywordPrefix] = CharKeywordPrefix;
+
+    // the smallest table where some seed gives every keyword its own slot
+    unsigned bits = 1;
+    while ((1u << bits) < ARRAY_LEN(syntax->keywords)) bits++;
+    for (; bits <= MACRO_SYNTAX_MAX_KEYWORD_BITS; bits++) {
+        syntax->keywordShift = 32 - bits;
+        for (uint32_t attempt = 0; attempt < MACRO_SYNTAX_SEED_ATTEMPTS; attempt++) {
+            syntax->keywordSeed = 2166136261u + attempt * 2654435761u;
+            memset(syntax->keywordSlots, 0, sizeof(syntax->keywordSlots));
+            bool perfect = true;
+            for (size_t i = 0; perfect && i < ARRAY_LEN(syntax->keywords); i++) {
+                unsigned char *slot = &syntax->keywordSlots[MacroSyntaxKeywordSlot(syntax, syntax->keywords[i].data, syntax->keywords[i].data_len)];
+                perfect = *slot == 0;
+                *slot = (unsigned char) (i + 1);
+            }
+            if (perfect) return true;
+        }
+    }
+    fprintf(stderr, "Invalid syntax: could not build the keyword table\n");
+    return false;
+}
+
+// spec is "<prefix><start><separator><end>[<variadic>]" followed by any number of "<keyword>=<name>" renames,
+// separated by spaces, the renamed keywords point into spec so it has to outlive the syntax
+bool MacroSyntaxParse(MacroSyntax *syntax, const char *spec, size_t spec_len) {
+    const char *end = spec + spec_len;
+    while (spec < end && is_space(*spec)) spec++;
+    const char *delimiters = spec;
+    while (spec < end && !is_space(*spec)) spec++;
+    size_t delimiters_len = (size_t) (spec - delimiters);
+    if (delimiters_len != 4 && delimiters_len != 5) {
+        fprintf(stderr, "Invalid syntax: expected 4 or 5 delimiters, got \"%.*s\"\n", (int) delimiters_len, delimiters);
+        return false;
+    }
+    syntax->keywordPrefix = delimiters[0];
+    syntax->argsStart = delimiters[1];
+    syntax->argsSeparator = delimiters[2];
+    syntax->argsEnd = delimiters[3];
+    if (delimiters_len == 5) syntax->variadicSymbol = delimiters[4];
+
+    for (;;) {
+        while (spec < end && is_space(*spec)) spec++;
+        if (spec == end) break;
+        const char *rename = spec;
+        while (spec < end && !is_space(*spec)) spec++;
+        const char *equals = memchr(rename, '=', (size_t) (spec - rename));
+        size_t i = 0;
+        for (; equals && i < ARRAY_LEN(MacroKeywords); i++) {
+            if (MacroKeywords[i].data_len == (size_t) (equals - rename) && strncmp(MacroKeywords[i].data, rename, MacroKeywords[i].data_len) == 0) break;
+        }
+        if (!equals || i == ARRAY_LEN(MacroKeywords)) {
+            fprintf(stderr, "Invalid syntax: expected <keyword>=<name>, got \"%.*s\"\n", (int) (spec - rename), rename);
+            return false;
+        }
+        syntax->keywords[i].data = equals + 1;
+        syntax->keywords[i].data_len = (size_t) (spec - equals - 1);
+    }
+    return MacroSyntaxBuild(syntax);
+}
+
+// FNV-1a
+size_t hashToken(const Token *token) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < token->data_len; i++) {
+        hash ^= (unsigned char) token->data[i];
+        hash *= 1099511628211ULL;
+    }
+    return (size_t) hash;
+}
+
 // increment by 1 and check for out of bounds
 bool LexerNext(Lexer *lexer) {
     if (lexer->current >= lexer->data_len) return false;
@@ -160,7 +477,15 @@ bool LexerNext(Lexer *lexer) {
     return lexer->current < lexer->data_len;
 }
 
+#ifdef MACROLANG_PIPELINE
+Token PipelineGetToken(Lexer *lexer);
+#endif // MACROLANG_PIPELINE
+
 Token GetToken(Lexer *lexer) {
+#ifdef MACROLANG_PIPELINE
+    if (lexer->pipeline) return PipelineGetToken(lexer);
+#endif // MACROLANG_PIPELINE
+
     Token token = {
         .data = &lexer->data[lexer->current],
     };
@@ -170,8 +495,9 @@ Token GetToken(Lexer *lexer) {
         return token;
     }
     // decide token type
+    const unsigned char *charClass = lexer->syntax->charClass;
     bool keywordPrefix = false;
-    if (LexerCurrent(lexer) == MACRO_KEYWORD_PREFIX) {
+    if (charClass[(unsigned char) LexerCurrent(lexer)] == CharKeywordPrefix) {
         keywordPrefix = true;
         token.data += 1;
         if (!LexerNext(lexer)) {
@@ -180,45 +506,48 @@ Token GetToken(Lexer *lexer) {
         }
     }
 
-    char cur = LexerCurrent(lexer);
-    if (cur == '\n') {
-        token.type = TokenNewline;
-        token.data_len += 1;
-        LexerNext(lexer);
-        return token;
-    } else if (is_symbol(cur)) {
-        token.type = TokenSymbol;
-        token.data_len += 1;
-        LexerNext(lexer);
-        return token;
-    } else if (is_space(cur)) {
-        token.type = TokenWhitespace;
-        token.data_len += 1;
-        LexerNext(lexer);
-        return token;
-    } else if (is_text(cur)) {
-        token.type = TokenText;
-    } else if (is_number(cur)) {
-        token.type = TokenNumber;
-    } else {
-        token.type = TokenNone;
+    switch (charClass[(unsigned char) LexerCurrent(lexer)]) {
+        case CharNewline:
+            token.type = TokenNewline;
+            token.data_len += 1;
+            LexerNext(lexer);
+            return token;
+        case CharSymbol:
+        case CharKeywordPrefix:
+            token.type = TokenSymbol;
+            token.data_len += 1;
+            LexerNext(lexer);
+            return token;
+        case CharSpace:
+            token.type = TokenWhitespace;
+            token.data_len += 1;
+            LexerNext(lexer);
+            return token;
+        case CharText: token.type = TokenText; break;
+        case CharNumber: token.type = TokenNumber; break;
+        default:
+            // passed through as is, one byte at a time
+            token.type = TokenNone;
+            token.data_len += 1;
+            LexerNext(lexer);
+            return token;
     }
 
     // decide token data
     if (token.type == TokenText || token.type == TokenNumber) {
+        CharClass class;
         do {
             token.data_len += 1;
             if (!LexerNext(lexer)) break;
-            cur = LexerCurrent(lexer);
-        } while (is_text(cur) || is_number(cur));
+            class = charClass[(unsigned char) LexerCurrent(lexer)];
+        } while (class == CharText || class == CharNumber);
     }
 
     if (keywordPrefix == true) {
-        for (size_t i = 0; i < ARRAY_LEN(MacroKeywords); i++) {
-            if (cmpToken(&token, &MacroKeywords[i])) {
-                token.type = MacroKeywords[i].type;
-                break;
-            }
+        const MacroSyntax *syntax = lexer->syntax;
+        unsigned char slot = syntax->keywordSlots[MacroSyntaxKeywordSlot(syntax, token.data, token.data_len)];
+        if (slot != 0 && cmpToken(&token, &syntax->keywords[slot - 1])) {
+            token.type = syntax->keywords[slot - 1].type;
         }
     }
 
@@ -242,14 +571,21 @@ Token GetTokenAndIgnore(Lexer *lexer, TokenType ignore) {
     return token;
 }
 
+#ifndef MACRO_ERROR_CONTEXT
+#    define MACRO_ERROR_CONTEXT (80) // characters of the line shown on each side of an error
+#endif // MACRO_ERROR_CONTEXT
+
+// only a window of the line is shown, so an error costs the same however long its line is
 void MacroError(Lexer *lexer) {
-    int line_len = 0;
-    while (lexer->data[lexer->current_line + line_len] != '\n' && lexer->data[lexer->current_line + line_len] != '\0') {
-        line_len++;
+    size_t start = lexer->current_line;
+    if (lexer->current - start > MACRO_ERROR_CONTEXT) start = lexer->current - MACRO_ERROR_CONTEXT;
+    size_t end = lexer->current;
+    while (end < lexer->data_len && end - lexer->current < MACRO_ERROR_CONTEXT && lexer->data[end] != '\n') {
+        end++;
     }
     fprintf(stderr, "\n----- ERROR -----\n");
-    fprintf(stderr, "%.*s\n", line_len, &LexerCurrentLine(lexer));
-    fprintf(stderr, "%*s\n", (int) (lexer->current - lexer->current_line), "^");
+    fprintf(stderr, "%.*s\n", (int) (end - start), &lexer->data[start]);
+    fprintf(stderr, "%*s\n", (int) (lexer->current - start), "^");
 }
 
 #define MacroReportError(lexer, fmt, ...)         \
@@ -259,32 +595,165 @@ void MacroError(Lexer *lexer) {
     } while (0)
 
 Macro *FindMatchingMacro(Token token) {
-    if (token.type == TokenText) {
-        DynamicArrayForeach(Macro, macro, &DefinedMacros) {
+    if (token.type == TokenText && DefinedMacros.buckets.count > 0) {
+        size_t hash = hashToken(&token);
+        size_t idx = DefinedMacros.buckets.data[hash & (DefinedMacros.buckets.count - 1)];
+        while (idx != 0) {
+            Macro *macro = &DefinedMacros.macros.data[idx - 1];
             assert(macro->key.data != NULL && macro->key.count > 0);
-            Token macroNameToken = macro->key.data[0];
-            if (cmpToken(&token, &macroNameToken)) {
-                return macro;
+            if (macro->hash == hash && cmpToken(&token, &macro->key.data[0])) {
+                return macro->type == MacroUndefined ? NULL : macro;
             }
+            idx = macro->next;
         }
     }
     return NULL;
 }
 
-int FindMatchingArgToValue(Macro *macro, const Token *value) {
-    for (int i = 1; i < macro->key.count; i++) {
-        if (cmpToken(&macro->key.data[i], value)) {
-            return i;
+void MacroTableLink(size_t idx) {
+    Macro *macro = &DefinedMacros.macros.data[idx];
+    size_t *bucket = &DefinedMacros.buckets.data[macro->hash & (DefinedMacros.buckets.count - 1)];
+    macro->next = *bucket;
+    *bucket = idx + 1;
+}
+
+void MacroTableAdd(Macro macro) {
+    macro.hash = hashToken(&macro.key.data[0]);
+    DynamicArrayAppend(&DefinedMacros.macros, macro);
+
+    MacroBuckets *buckets = &DefinedMacros.buckets;
+    if (DefinedMacros.macros.count > buckets->count) {
+        // relinking in definition order keeps every chain newest first
+        size_t bucketCount = buckets->count ? buckets->count * 2 : MACRO_TABLE_DEFAULT_BUCKETS;
+        DynamicArrayReserve(buckets, bucketCount);
+        memset(buckets->data, 0, bucketCount * sizeof(*buckets->data));
+        buckets->count = bucketCount;
+        for (size_t i = 0; i < DefinedMacros.macros.count; i++) {
+            MacroTableLink(i);
         }
+    } else {
+        MacroTableLink(DefinedMacros.macros.count - 1);
     }
-    return -1;
+}
+
+void MacroPushScope(void) {
+    MacroScope scope = {
+        .macroCount = DefinedMacros.macros.count,
+        .arenaMark = DynamicArenaGetMark(&DefinedMacros.arena),
+    };
+    DynamicArrayAppend(&DefinedMacros.scopes, scope);
+}
+
+bool MacroPopScope(Lexer *lexer) {
+    if (DynamicArrayIsEmpty(&DefinedMacros.scopes)) {
+        const Token *pop = MacroSyntaxKeyword(lexer->syntax, TokenPopKeyword);
+        const Token *push = MacroSyntaxKeyword(lexer->syntax, TokenPushKeyword);
+        MacroReportError(lexer, "%c" Token_Fmt " without a matching %c" Token_Fmt, lexer->syntax->keywordPrefix, Token_Arg(pop), lexer->syntax->keywordPrefix, Token_Arg(push));
+        return false;
+    }
+    MacroScope scope = DefinedMacros.scopes.data[--DefinedMacros.scopes.count];
+
+    // macros are removed in reverse definition order so each one is still the head of its chain
+    while (DefinedMacros.macros.count > scope.macroCount) {
+        Macro *macro = &DefinedMacros.macros.data[--DefinedMacros.macros.count];
+        DefinedMacros.buckets.data[macro->hash & (DefinedMacros.buckets.count - 1)] = macro->next;
+    }
+    DynamicArenaReset(&DefinedMacros.arena, scope.arenaMark);
+    return true;
+}
+
+// forgets every macro and scope so the next input starts from an empty table, keeps the arrays allocated
+void MacroTableReset(void) {
+    DefinedMacros.macros.count = 0;
+    DefinedMacros.scopes.count = 0;
+    if (DefinedMacros.buckets.count > 0) {
+        memset(DefinedMacros.buckets.data, 0, DefinedMacros.buckets.count * sizeof(*DefinedMacros.buckets.data));
+    }
+    DynamicArenaReset(&DefinedMacros.arena, (DynamicArenaMark){0});
+}
+
+// for directives that must be alone on their line
+bool MacroDirectiveEnd(Lexer *lexer, TokenType directive) {
+    Token token = GetTokenAndIgnore(lexer, TokenWhitespace);
+    if (token.type != TokenNewline && token.type != TokenEnd) {
+        MacroReportError(lexer, "Unexpected \"" Token_Fmt "\" after %c" Token_Fmt, Token_Arg(&token), lexer->syntax->keywordPrefix, Token_Arg(MacroSyntaxKeyword(lexer->syntax, directive)));
+        return false;
+    }
+    return true;
+}
+
+bool isOperatorKeyword(const Token *token) {
+    return token->type == TokenCountKeyword || token->type == TokenAtKeyword || token->type == TokenEachKeyword;
+}
+
+// sets closeOffset of every args start that has a matching args end in tokens, with the nesting MacroSplitArgs uses
+void MacroMatchGroups(const MacroSyntax *syntax, Tokens *tokens) {
+    MacroBuckets open = {.allocator = &ExpansionArena.allocator};
+    for (size_t i = 0; i < tokens->count; i++) {
+        Token *token = &tokens->data[i];
+        if (token->type != TokenSymbol) continue;
+        if (token->data[0] == syntax->argsStart) {
+            DynamicArrayAppend(&open, i);
+        } else if (token->data[0] == syntax->argsEnd && open.count > 0) {
+            size_t start = open.data[--open.count];
+            if (i - start <= UINT32_MAX) tokens->data[start].closeOffset = (uint32_t) (i - start);
+        }
+    }
+}
+
+// resolves every value token against the parameters once, duplicate parameter names resolve to the first one
+void MacroResolveValue(Macro *macro) {
+    size_t paramCount = macro->key.count - 1;
+    size_t slotCount = 1;
+    while (slotCount < paramCount * 2) slotCount *= 2;
+    MacroBuckets slots = {.allocator = &ExpansionArena.allocator}; // parameter index by hash, 0 == empty
+    DynamicArrayReserve(&slots, slotCount);
+    memset(slots.data, 0, slotCount * sizeof(*slots.data));
+    for (size_t param = 1; param <= paramCount; param++) {
+        size_t slot = hashToken(&macro->key.data[param]) & (slotCount - 1);
+        while (slots.data[slot] != 0 && !cmpToken(&macro->key.data[slots.data[slot]], &macro->key.data[param])) {
+            slot = (slot + 1) & (slotCount - 1);
+        }
+        if (slots.data[slot] == 0) slots.data[slot] = param;
+    }
+
+    DynamicArrayReserve(&macro->refs, macro->value.count + 1);
+    size_t uses = 0;
+    for (size_t i = 0; i <= macro->value.count; i++) {
+        MacroValueRef ref = {.usesBefore = uses};
+        const Token *token = i < macro->value.count ? &macro->value.data[i] : NULL;
+        if (token && token->type == TokenText) {
+            size_t slot = hashToken(token) & (slotCount - 1);
+            while (slots.data[slot] != 0 && !cmpToken(&macro->key.data[slots.data[slot]], token)) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            ref.argIdx = (int) slots.data[slot];
+        }
+        if (ref.argIdx > 0 || (token && isOperatorKeyword(token))) uses++;
+        DynamicArrayAppend(&macro->refs, ref);
+    }
+}
+
+// the parameter a token of the macro value names, 1 based, 0 for none
+int MacroValueArg(const Macro *macro, const Token *token) {
+    size_t idx = (size_t) (token - macro->value.data);
+    assert(idx < macro->value.count);
+    return macro->refs.data[idx].argIdx;
+}
+
+// whether a span of the macro value names a parameter or uses an operator
+bool MacroSpanUsesParams(const Macro *macro, TokenSpan span) {
+    size_t start = (size_t) (span.data - macro->value.data);
+    assert(start + span.count <= macro->value.count);
+    return macro->refs.data[start + span.count].usesBefore > macro->refs.data[start].usesBefore;
 }
 
 bool MacroDefine(Lexer *lexer) {
     Macro macro = {
         // the printing is for debugging
-        .key = {.printFunc = printToken},
-        .value = {.printFunc = printToken},
+        .key = {.allocator = &DefinedMacros.arena.allocator, .printFunc = printToken},
+        .value = {.allocator = &DefinedMacros.arena.allocator, .printFunc = printToken},
+        .refs = {.allocator = &DefinedMacros.arena.allocator},
     };
 
     Token macroNameToken = GetTokenAndIgnore(lexer, TokenWhitespace);
@@ -296,7 +765,7 @@ bool MacroDefine(Lexer *lexer) {
     Token macroValueToken = {0};
 
     Token macroArgToken = GetTokenAndIgnore(lexer, TokenWhitespace);
-    if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == MACRO_ARGS_START) {
+    if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->argsStart) {
         macro.type = MacroArgs;
         macroArgToken = GetTokenAndIgnore(lexer, TokenWhitespace);
         while (macroArgToken.type != TokenEnd && macroArgToken.type != TokenNewline) {
@@ -308,10 +777,26 @@ bool MacroDefine(Lexer *lexer) {
             DynamicArrayAppend(&macro.key, macroArgToken);
             macroArgToken = GetTokenAndIgnore(lexer, TokenWhitespace);
 
+            if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->variadicSymbol) {
+                for (int i = 1; i < 3; i++) {
+                    macroArgToken = GetToken(lexer);
+                    if (macroArgToken.type != TokenSymbol || macroArgToken.data[0] != lexer->syntax->variadicSymbol) {
+                        MacroReportError(lexer, "Invalid variadic argument for macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
+                        return false;
+                    }
+                }
+                macro.variadic = true;
+                macroArgToken = GetTokenAndIgnore(lexer, TokenWhitespace);
+                if (macroArgToken.type != TokenSymbol || macroArgToken.data[0] != lexer->syntax->argsEnd) {
+                    MacroReportError(lexer, "Variadic argument must be the last argument of macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
+                    return false;
+                }
+            }
+
             if (macroArgToken.type == TokenSymbol) {
-                if (macroArgToken.data[0] == MACRO_ARGS_END) {
+                if (macroArgToken.data[0] == lexer->syntax->argsEnd) {
                     break;
-                } else if (macroArgToken.data[0] != MACRO_ARGS_SEPARATOR) {
+                } else if (macroArgToken.data[0] != lexer->syntax->argsSeparator) {
                     MacroReportError(lexer, "Invalid symbol in macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
                     return false;
                 }
@@ -332,162 +817,980 @@ bool MacroDefine(Lexer *lexer) {
         DynamicArrayAppend(&macro.value, macroValueToken);
         macroValueToken = GetToken(lexer);
     }
-    DynamicArrayAppend(&DefinedMacros, macro);
+    MacroMatchGroups(lexer->syntax, &macro.value);
+    if (macro.type == MacroArgs) MacroResolveValue(&macro);
+    MacroTableAdd(macro);
     return true;
 }
 
-bool MacroCollectArgs(Lexer *lexer, const Macro *macro, Tokens *macroTokens) {
-    LexerMark mark = GetMark(lexer);
-    Token macroArgToken = GetToken(lexer);
-    if (macroArgToken.type != TokenSymbol || macroArgToken.data[0] != MACRO_ARGS_START) {
-        // the token only has the same name but it isnt an activation of the macro
-        SetMark(lexer, mark);
-        return true;
+bool MacroUndef(Lexer *lexer) {
+    Token macroNameToken = GetTokenAndIgnore(lexer, TokenWhitespace);
+    if (macroNameToken.type != TokenText) {
+        MacroReportError(lexer, "Invalid Macro Name");
+        return false;
     }
-    DynamicArrayAppend(macroTokens, macroArgToken);
-    Token macroNameToken = macro->key.data[0]; // for error reporting
-    int arg = 1;
+    if (!MacroDirectiveEnd(lexer, TokenUndefKeyword)) return false;
+    if (!FindMatchingMacro(macroNameToken)) return true;
+
+    Macro macro = {
+        .type = MacroUndefined,
+        .key = {.allocator = &DefinedMacros.arena.allocator, .printFunc = printToken},
+    };
+    DynamicArrayAppend(&macro.key, macroNameToken);
+    MacroTableAdd(macro);
+    return true;
+}
 
-    macroArgToken = GetToken(lexer);
-    while (macroArgToken.type != TokenEnd && macroArgToken.type != TokenNewline) {
-        if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == MACRO_ARGS_SEPARATOR) {
-            if (arg == macro->key.count - 1) {
+// a macro call whose arguments are being collected
+typedef struct {
+    const Macro *macro;
+    size_t arg;
+    size_t groups; // args starts inside the current argument that do not start a call, their separators are not counted
+} MacroCall;
+
+DynamicArrayDef(MacroCalls, MacroCall);
+
+// nested calls are kept on calls instead of the C stack, so deep nesting is only limited by memory
+bool MacroCollectArgs(Lexer *lexer, const Macro *macro, Tokens *macroTokens) {
+    MacroCalls calls = {.allocator = &ExpansionArena.allocator};
+    const Macro *opening = macro; // a macro name was just collected, its args start may follow
+    for (;;) {
+        if (opening) {
+            LexerMark mark = GetMark(lexer);
+            Token macroArgToken = GetToken(lexer);
+            if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->argsStart) {
+                DynamicArrayAppend(macroTokens, macroArgToken);
+                DynamicArrayAppend(&calls, ((MacroCall){.macro = opening, .arg = 1}));
+            } else {
+                // the token only has the same name but it isnt an activation of the macro
+                SetMark(lexer, mark);
+                if (DynamicArrayIsEmpty(&calls)) return true;
+            }
+            opening = NULL;
+            continue;
+        }
+
+        MacroCall *call = &calls.data[calls.count - 1];
+        Token macroNameToken = call->macro->key.data[0]; // for error reporting
+        size_t paramCount = call->macro->key.count - 1;
+        Token macroArgToken = GetToken(lexer);
+        if (macroArgToken.type == TokenEnd || macroArgToken.type == TokenNewline) {
+            MacroReportError(lexer, "Unfinished use of macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
+            return false;
+        }
+
+        if (macroArgToken.type == TokenSymbol && call->groups > 0) {
+            // split the same way as MacroSplitArgs, a group is part of the argument it is in
+            if (macroArgToken.data[0] == lexer->syntax->argsStart) call->groups++;
+            if (macroArgToken.data[0] == lexer->syntax->argsEnd) call->groups--;
+        } else if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->argsStart) {
+            call->groups++;
+        } else if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->argsSeparator) {
+            if (!call->macro->variadic && call->arg == paramCount) {
                 MacroReportError(lexer, "Too many arguments to macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
                 return false;
             }
-            DynamicArrayAppend(macroTokens, macroArgToken);
-            arg++;
-            goto notArg;
-        } else if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == MACRO_ARGS_END) {
-            if (arg < macro->key.count - 1) {
+            call->arg++;
+        } else if (macroArgToken.type == TokenSymbol && macroArgToken.data[0] == lexer->syntax->argsEnd) {
+            if (call->arg < paramCount - call->macro->variadic) {
                 MacroReportError(lexer, "Too few arguments to macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
                 return false;
             }
-            DynamicArrayAppend(macroTokens, macroArgToken);
-            break;
+            calls.count--;
         } else if (macroArgToken.type == TokenText) {
             Macro *nestedMacro = FindMatchingMacro(macroArgToken);
-            if (nestedMacro && nestedMacro->type == MacroArgs) {
-                DynamicArrayAppend(macroTokens, macroArgToken);
-                if (!MacroCollectArgs(lexer, nestedMacro, macroTokens)) return false;
-                goto notArg;
+            if (nestedMacro && nestedMacro->type == MacroArgs) opening = nestedMacro;
+        }
+        DynamicArrayAppend(macroTokens, macroArgToken);
+        if (DynamicArrayIsEmpty(&calls)) return true;
+    }
+}
+
+bool isArgsStart(const MacroSyntax *syntax, const Token *token) {
+    return token->type == TokenSymbol && token->data[0] == syntax->argsStart;
+}
+
+bool MacroIsPack(const Macro *macro, int argIdx) {
+    return macro->variadic && (size_t) argIdx == macro->key.count - 1;
+}
+
+TokenSpan TokenSpanTrim(TokenSpan span) {
+    while (span.count > 0 && span.data[0].type == TokenWhitespace) {
+        span.data++;
+        span.count--;
+    }
+    while (span.count > 0 && span.data[span.count - 1].type == TokenWhitespace) {
+        span.count--;
+    }
+    return span;
+}
+
+// tokens.data[start] is the argsStart of a call, appends one span per argument
+// returns the index after the matching argsEnd, or 0 if the call is never closed
+// nested groups with a known closeOffset are skipped whole, so nested calls are not rescanned at every level
+size_t MacroSplitArgs(const MacroSyntax *syntax, TokenSpan tokens, size_t start, TokenSpans *argSpans) {
+    size_t argStart = start + 1;
+    int start_end = 1;
+    for (size_t i = start + 1; i < tokens.count; i++) {
+        const Token *token = &tokens.data[i];
+        if (token->type != TokenSymbol) continue;
+        if (token->data[0] == syntax->argsStart) {
+            if (token->closeOffset > 0 && i + token->closeOffset < tokens.count) {
+                i += token->closeOffset;
+                continue;
             }
+            start_end++;
+        } else if (token->data[0] == syntax->argsSeparator && start_end == 1) {
+            DynamicArrayAppend(argSpans, ((TokenSpan){tokens.data + argStart, i - argStart}));
+            argStart = i + 1;
+        } else if (token->data[0] == syntax->argsEnd && --start_end == 0) {
+            DynamicArrayAppend(argSpans, ((TokenSpan){tokens.data + argStart, i - argStart}));
+            return i + 1;
         }
+    }
+    return 0;
+}
 
-        DynamicArrayAppend(macroTokens, macroArgToken);
-    notArg:
-        macroArgToken = GetToken(lexer);
+size_t MacroFrameDepth(const MacroFrame *frame) {
+    return frame ? frame->depth : 0;
+}
+
+// moves the activeCount of every macro from the current context to the chain ending at context,
+// only the frames that are not shared by both chains are touched, so entering a new frame is O(1)
+// and jumping back to the call site of a forwarded argument costs the frames jumped over
+const MacroFrame *MacroSwitchContext(const MacroFrame *context) {
+    const MacroFrame *previous = ExpansionContext;
+    const MacroFrame *from = previous;
+    const MacroFrame *to = context;
+    while (from != to) {
+        if (MacroFrameDepth(from) >= MacroFrameDepth(to)) {
+            from->macro->activeCount--;
+            from = from->parent;
+        } else {
+            to->macro->activeCount++;
+            to = to->parent;
+        }
     }
-    if (macroArgToken.type == TokenEnd || macroArgToken.type == TokenNewline) {
-        MacroReportError(lexer, "Unfinished use of macro \"" Token_Fmt "\"", Token_Arg(&macroNameToken));
+    ExpansionContext = context;
+    return previous;
+}
+
+// true when the macro is being expanded in the current context, macros are not expanded again inside themselves
+bool MacroIsActive(const Macro *macro) {
+    return macro->activeCount > 0;
+}
+
+bool MacroExpand(Lexer *lexer, TokenSpan tokens, const MacroFrame *params, const MacroFrame *active, Tokens *expandedTokens);
+
+// expands the value of the macro of frame, every invocation recurses a bounded number of times in between,
+// so limiting the invocations in progress makes deep inputs fail with an error instead of overflowing the stack
+bool MacroExpandFrame(Lexer *lexer, const MacroFrame *frame, const MacroFrame *params, Tokens *expandedTokens) {
+    if (ExpansionDepth >= MACRO_MAX_EXPANSION_DEPTH) {
+        MacroReportError(lexer, "Macro expansion is nested more than %d levels deep", MACRO_MAX_EXPANSION_DEPTH);
+        return false;
+    }
+    ExpansionDepth++;
+    bool ok = MacroExpand(lexer, (TokenSpan){frame->macro->value.data, frame->macro->value.count}, params, frame, expandedTokens);
+    ExpansionDepth--;
+    return ok;
+}
+
+bool MacroInvoke(Lexer *lexer, Macro *macro, const MacroBinding *args, size_t argCount, const MacroFrame *active, Tokens *expandedTokens) {
+    size_t paramCount = macro->key.count - 1;
+    if (macro->variadic ? argCount < paramCount - 1 : argCount != paramCount) {
+        MacroReportError(lexer, "Wrong number of arguments to macro \"" Token_Fmt "\"", Token_Arg(&macro->key.data[0]));
         return false;
     }
+    MacroFrame frame = {
+        .macro = macro,
+        .args = args,
+        .argCount = argCount,
+        .parent = active,
+        .depth = MacroFrameDepth(active) + 1,
+    };
+    return MacroExpandFrame(lexer, &frame, &frame, expandedTokens);
+}
+
+// arguments are expanded where they are substituted, in the context of the call site they were written at
+bool MacroExpandArg(Lexer *lexer, const MacroFrame *params, int argIdx, Tokens *expandedTokens) {
+    size_t first = argIdx - 1;
+    if (!MacroIsPack(params->macro, argIdx)) {
+        return MacroExpand(lexer, params->args[first].span, NULL, params->args[first].context, expandedTokens);
+    }
+    for (size_t i = first; i < params->argCount; i++) {
+        if (i > first) {
+            Token separator = {
+                .type = TokenSymbol,
+                .data = &lexer->syntax->argsSeparator,
+                .data_len = 1,
+            };
+            DynamicArrayAppend(expandedTokens, separator);
+        }
+        if (!MacroExpand(lexer, params->args[i].span, NULL, params->args[i].context, expandedTokens)) return false;
+    }
+    return true;
+}
+
+// an argument that is just a parameter of the enclosing macro is forwarded as the bindings of that parameter,
+// a variadic parameter forwards every binding of the pack, nothing is copied or rescanned
+// arguments that mix parameters with other tokens are expanded into the expansion arena first
+bool MacroResolveArg(Lexer *lexer, TokenSpan arg, const MacroFrame *params, const MacroFrame *active, MacroBindings *args) {
+    if (!params) {
+        DynamicArrayAppend(args, ((MacroBinding){arg, active}));
+        return true;
+    }
+
+    TokenSpan trimmed = TokenSpanTrim(arg);
+    int argIdx = trimmed.count == 1 && trimmed.data[0].type == TokenText ? MacroValueArg(params->macro, &trimmed.data[0]) : 0;
+    if (argIdx > 0) {
+        size_t first = argIdx - 1;
+        if (MacroIsPack(params->macro, argIdx)) {
+            DynamicArrayAppendMany(args, params->args + first, params->argCount - first);
+        } else {
+            DynamicArrayAppend(args, params->args[first]);
+        }
+        return true;
+    }
+
+    if (!MacroSpanUsesParams(params->macro, arg)) {
+        DynamicArrayAppend(args, ((MacroBinding){arg, active}));
+        return true;
+    }
+
+    Tokens resolved = {
+        .allocator = &ExpansionArena.allocator,
+        .printFunc = printToken,
+    };
+    if (!MacroExpand(lexer, arg, params, active, &resolved)) return false;
+    DynamicArrayAppend(args, ((MacroBinding){{resolved.data, resolved.count}, active}));
+    return true;
+}
+
+// operators only mean something in the value of a macro with arguments, anywhere else they are text
+bool MacroExpandOperator(Lexer *lexer, TokenSpan tokens, size_t *idx, const MacroFrame *params, const MacroFrame *active, Tokens *expandedTokens) {
+    const Token *operator = &tokens.data[*idx];
+
+    TokenSpans operands = {.allocator = &ExpansionArena.allocator};
+    size_t end = *idx + 1 < tokens.count && isArgsStart(lexer->syntax, &tokens.data[*idx + 1]) ? MacroSplitArgs(lexer->syntax, tokens, *idx + 1, &operands) : 0;
+    size_t expectedOperands = operator->type == TokenCountKeyword ? 1 : 2;
+    if (end == 0 || operands.count != expectedOperands) {
+        MacroReportError(lexer, "%c" Token_Fmt " expects %zu argument(s)", lexer->syntax->keywordPrefix, Token_Arg(operator), expectedOperands);
+        return false;
+    }
+    *idx = end - 1;
+
+    TokenSpan packName = TokenSpanTrim(operands.data[0]);
+    int argIdx = packName.count == 1 && packName.data[0].type == TokenText ? MacroValueArg(params->macro, &packName.data[0]) : 0;
+    if (argIdx <= 0 || !MacroIsPack(params->macro, argIdx)) {
+        MacroReportError(lexer, "First argument of %c" Token_Fmt " must be a variadic parameter", lexer->syntax->keywordPrefix, Token_Arg(operator));
+        return false;
+    }
+    const MacroBinding *pack = params->args + argIdx - 1;
+    size_t packCount = params->argCount - (argIdx - 1);
+
+    TokenSpan operand = expectedOperands > 1 ? TokenSpanTrim(operands.data[1]) : (TokenSpan){0};
+    if (operator->type == TokenCountKeyword) {
+        char *text = DynamicAllocatorRealloc(&ExpansionArena.allocator, NULL, 0, 32);
+        int len = snprintf(text, 32, "%zu", packCount);
+        DynamicArrayAppend(expandedTokens, ((Token){.type = TokenNumber, .data = text, .data_len = len}));
+    } else if (operator->type == TokenAtKeyword) {
+        size_t index = 0;
+        bool valid = operand.count == 1 && operand.data[0].type == TokenNumber;
+        for (size_t i = 0; valid && i < operand.data[0].data_len; i++) {
+            index = index * 10 + (operand.data[0].data[i] - '0');
+        }
+        if (!valid || index >= packCount) {
+            MacroReportError(lexer, "Invalid index for %c" Token_Fmt ", the pack has %zu argument(s)", lexer->syntax->keywordPrefix, Token_Arg(operator), packCount);
+            return false;
+        }
+        return MacroExpand(lexer, TokenSpanTrim(pack[index].span), NULL, pack[index].context, expandedTokens);
+    } else if (operator->type == TokenEachKeyword) {
+        Macro *macro = operand.count == 1 ? FindMatchingMacro(operand.data[0]) : NULL;
+        if (!macro || macro->type != MacroArgs || MacroIsActive(macro)) {
+            MacroReportError(lexer, "Second argument of %c" Token_Fmt " must be a macro with arguments", lexer->syntax->keywordPrefix, Token_Arg(operator));
+            return false;
+        }
+        for (size_t i = 0; i < packCount; i++) {
+            MacroBinding element = {TokenSpanTrim(pack[i].span), pack[i].context};
+            if (!MacroInvoke(lexer, macro, &element, 1, active, expandedTokens)) return false;
+        }
+    } else {
+        UNREACHABLE("Unknown operator");
+    }
     return true;
 }
 
-bool MacroExpand(Tokens *tokens, Tokens *expandedTokens) {
-    DynamicArrayForeach(Token, token, tokens) {
+// params is the activation whose parameters can appear in tokens, NULL for arguments and value macros
+// active is the chain of macros being expanded, they are not expanded again inside themselves
+bool MacroExpandSpan(Lexer *lexer, TokenSpan tokens, const MacroFrame *params, const MacroFrame *active, Tokens *expandedTokens) {
+    for (size_t i = 0; i < tokens.count; i++) {
+        const Token *token = &tokens.data[i];
+        if (params && token->type == TokenText) {
+            int argIdx = MacroValueArg(params->macro, token);
+            if (argIdx > 0) {
+                if (!MacroExpandArg(lexer, params, argIdx, expandedTokens)) return false;
+                continue;
+            }
+        }
+        if (params && isOperatorKeyword(token)) {
+            if (!MacroExpandOperator(lexer, tokens, &i, params, active, expandedTokens)) return false;
+            continue;
+        }
+
         Macro *macro = FindMatchingMacro(*token);
-        if (!macro) {
+        if (!macro || MacroIsActive(macro)) {
         notMacro:
             DynamicArrayAppend(expandedTokens, *token);
+            expandedTokens->data[expandedTokens->count - 1].closeOffset = 0; // only valid in the tokens it was matched in
         } else if (macro->type == MacroValue) {
-            MacroExpand(&macro->value, expandedTokens);
+            MacroFrame frame = {
+                .macro = macro,
+                .parent = active,
+                .depth = MacroFrameDepth(active) + 1,
+            };
+            if (!MacroExpandFrame(lexer, &frame, NULL, expandedTokens)) return false;
         } else if (macro->type == MacroArgs) {
-            token++; // consume the macro names
-            if (token >= (tokens)->data + (tokens)->count || token->type != TokenSymbol || token->data[0] != MACRO_ARGS_START) {
-                token--;
-                goto notMacro;
+            if (i + 1 >= tokens.count || !isArgsStart(lexer->syntax, &tokens.data[i + 1])) goto notMacro;
+            TokenSpans argSpans = {.allocator = &ExpansionArena.allocator};
+            size_t end = MacroSplitArgs(lexer->syntax, tokens, i + 1, &argSpans);
+            if (end == 0) goto notMacro;
+            // NAME() is a call with no arguments when everything is variadic
+            if (macro->variadic && macro->key.count == 2 && argSpans.count == 1 && TokenSpanTrim(argSpans.data[0]).count == 0) {
+                argSpans.count = 0;
             }
-            token++; // consume MACRO_ARGS_START
-            DynamicArrayForeach(Token, macroValueToken, &macro->value) {
-                int argIdx = FindMatchingArgToValue(macro, macroValueToken);
-                if (argIdx > 0) {
-                    Tokens argTokens = {
-                        .printFunc = printToken,
-                    };
-
-                    for (int start_end = 1; token < (tokens)->data + (tokens)->count; token++) {
-                        if (token->type == TokenSymbol) {
-                            if (token->data[0] == MACRO_ARGS_START) {
-                                start_end++;
-                            } else if (token->data[0] == MACRO_ARGS_SEPARATOR && start_end == 1) {
-                                token++;
-                                break;
-                            } else if (token->data[0] == MACRO_ARGS_END) {
-                                start_end--;
-                            }
-                        }
-                        if (start_end == 0) break;
-                        DynamicArrayAppend(&argTokens, *token);
-                    }
-                    MacroExpand(&argTokens, expandedTokens);
-                    DynamicArrayDestroy(&argTokens);
-                } else {
-                    DynamicArrayAppend(expandedTokens, *macroValueToken);
-                }
+
+            MacroBindings args = {.allocator = &ExpansionArena.allocator};
+            DynamicArrayReserve(&args, argSpans.count);
+            DynamicArrayForeach(TokenSpan, argSpan, &argSpans) {
+                if (!MacroResolveArg(lexer, *argSpan, params, active, &args)) return false;
             }
+            if (!MacroInvoke(lexer, macro, args.data, args.count, active, expandedTokens)) return false;
+            i = end - 1;
         }
     }
     return true;
 }
 
+// expands tokens with the activeCount of every macro counted for active
+bool MacroExpand(Lexer *lexer, TokenSpan tokens, const MacroFrame *params, const MacroFrame *active, Tokens *expandedTokens) {
+    const MacroFrame *previous = MacroSwitchContext(active);
+    bool ok = MacroExpandSpan(lexer, tokens, params, active, expandedTokens);
+    MacroSwitchContext(previous);
+    return ok;
+}
+
+#ifdef MACROLANG_PIPELINE
+
+#    ifndef MACRO_PIPELINE_BATCH_SIZE
+#        define MACRO_PIPELINE_BATCH_SIZE (1024) // tokens per batch sent to the expander
+#    endif // MACRO_PIPELINE_BATCH_SIZE
+#    ifndef MACRO_PIPELINE_CHUNK_SIZE
+#        define MACRO_PIPELINE_CHUNK_SIZE (64 * 1024) // output bytes per chunk sent to the writer
+#    endif // MACRO_PIPELINE_CHUNK_SIZE
+#    ifndef MACRO_PIPELINE_RING_SIZE
+#        define MACRO_PIPELINE_RING_SIZE (64) // batches/chunks in flight between two stages
+#    endif // MACRO_PIPELINE_RING_SIZE
+#    ifndef MACRO_PIPELINE_SPINS
+#        define MACRO_PIPELINE_SPINS (64) // yields before a stage waiting on a ring goes to sleep
+#    endif // MACRO_PIPELINE_SPINS
+
+typedef struct {
+    Token token;
+    LexerMark end; // lexer position after the token, restored on the expander for error reporting
+} PipelineToken;
+
+typedef struct {
+    PipelineToken tokens[MACRO_PIPELINE_BATCH_SIZE];
+    size_t count;
+} TokenBatch;
+
+// lexer thread -> tokenBatches -> expander (MacroLang) -> outputChunks -> writer thread
+// the free rings send consumed batches and chunks back so they get reused instead of reallocated,
+// they are twice as big as the forward rings so giving something back never fails
+typedef struct MacroPipeline {
+    Lexer lexer;                     // owned by the lexer thread
+    DynamicAllocator batchAllocator; // owned by the lexer thread, the default allocator isnt thread safe
+    FILE *outputFile;
+    SpscRing tokenBatches;
+    SpscRing freeTokenBatches;
+    SpscRing outputChunks; // a NULL chunk ends the stream
+    SpscRing freeOutputChunks;
+    atomic_bool stop;
+
+    // a stage that waited too long on a ring sleeps on wake until progress changes
+    mtx_t lock;
+    cnd_t wake;
+    atomic_size_t progress; // bumped after every item pushed to or popped from a forward ring
+    atomic_size_t sleepers;
+
+    // only touched by the expander
+    TokenBatch *batch;
+    size_t batchIdx;
+    PipelineToken last;
+    LexerMark lastStart;
+    bool pushedBack;
+    bool ended;
+} MacroPipeline;
+
+// called after moving an item through a forward ring or stopping the pipeline
+void PipelineWake(MacroPipeline *pipeline) {
+    atomic_fetch_add(&pipeline->progress, 1);
+    if (atomic_load(&pipeline->sleepers) == 0) return;
+    mtx_lock(&pipeline->lock);
+    cnd_broadcast(&pipeline->wake);
+    mtx_unlock(&pipeline->lock);
+}
+
+// seen is the progress read before the ring was found full or empty, spins counts the waits so far
+// progress and sleepers are both seq_cst, so either the waker sees the sleeper or the sleeper sees the new progress
+void PipelineWait(MacroPipeline *pipeline, size_t seen, size_t *spins) {
+    if ((*spins)++ < MACRO_PIPELINE_SPINS) {
+        thrd_yield();
+        return;
+    }
+    mtx_lock(&pipeline->lock);
+    atomic_fetch_add(&pipeline->sleepers, 1);
+    while (atomic_load(&pipeline->progress) == seen) {
+        cnd_wait(&pipeline->wake, &pipeline->lock);
+    }
+    atomic_fetch_sub(&pipeline->sleepers, 1);
+    mtx_unlock(&pipeline->lock);
+}
+
+// false when stoppable and the pipeline was stopped before the item could be pushed
+bool PipelinePush(MacroPipeline *pipeline, SpscRing *ring, void *item, bool stoppable) {
+    for (size_t spins = 0;;) {
+        size_t seen = atomic_load(&pipeline->progress);
+        if (stoppable && atomic_load(&pipeline->stop)) return false;
+        if (SpscRingTryPush(ring, item)) break;
+        PipelineWait(pipeline, seen, &spins);
+    }
+    PipelineWake(pipeline);
+    return true;
+}
+
+void PipelinePop(MacroPipeline *pipeline, SpscRing *ring, void **item) {
+    for (size_t spins = 0;;) {
+        size_t seen = atomic_load(&pipeline->progress);
+        if (SpscRingTryPop(ring, item)) break;
+        PipelineWait(pipeline, seen, &spins);
+    }
+    PipelineWake(pipeline);
+}
+
+int PipelineLexerThread(void *arg) {
+    MacroPipeline *pipeline = arg;
+    TokenBatch *batch = NULL;
+    for (;;) {
+        if (!batch && !SpscRingTryPop(&pipeline->freeTokenBatches, (void **) &batch)) {
+            batch = DynamicAllocatorRealloc(&pipeline->batchAllocator, NULL, 0, sizeof(*batch));
+            assert(batch != NULL && "Buy more RAM!!!");
+        }
+        batch->count = 0;
+
+        bool ended = false;
+        while (batch->count < MACRO_PIPELINE_BATCH_SIZE && !ended) {
+            PipelineToken *entry = &batch->tokens[batch->count++];
+            entry->token = GetToken(&pipeline->lexer);
+            entry->end = GetMark(&pipeline->lexer);
+            ended = entry->token.type == TokenEnd;
+        }
+        if (!PipelinePush(pipeline, &pipeline->tokenBatches, batch, true)) {
+            DynamicAllocatorFree(&pipeline->batchAllocator, batch, sizeof(*batch));
+            return 0;
+        }
+        batch = NULL;
+        if (ended) return 0;
+    }
+}
+
+Token PipelineGetToken(Lexer *lexer) {
+    MacroPipeline *pipeline = lexer->pipeline;
+    LexerMark start = GetMark(lexer);
+
+    if (pipeline->pushedBack) {
+        pipeline->pushedBack = false;
+    } else if (!pipeline->ended) {
+        while (!pipeline->batch || pipeline->batchIdx == pipeline->batch->count) {
+            if (pipeline->batch) {
+                bool pushed = SpscRingTryPush(&pipeline->freeTokenBatches, pipeline->batch);
+                assert(pushed && "Free token batch ring is full");
+            }
+            PipelinePop(pipeline, &pipeline->tokenBatches, (void **) &pipeline->batch);
+            pipeline->batchIdx = 0;
+        }
+        pipeline->last = pipeline->batch->tokens[pipeline->batchIdx++];
+        pipeline->ended = pipeline->last.token.type == TokenEnd;
+    }
+    pipeline->lastStart = start;
+
+    lexer->current = pipeline->last.end.current;
+    lexer->current_line = pipeline->last.end.current_line;
+    return pipeline->last.token;
+}
+
+// the tokens are already gone from the ring, so only going back over the last token is possible
+// which is all the lookahead MacroLang needs
+void PipelineSetMark(Lexer *lexer, LexerMark mark) {
+    MacroPipeline *pipeline = lexer->pipeline;
+    if (mark.current == lexer->current) return;
+    assert(!pipeline->pushedBack && mark.current == pipeline->lastStart.current && "Pipeline can only go back one token");
+    pipeline->pushedBack = true;
+}
+
+// hands the filled output to the writer and leaves output_ds with an empty chunk
+void PipelineFlushOutput(MacroPipeline *pipeline, DynamicString *output_ds) {
+    DynamicString *chunk = NULL;
+    if (!SpscRingTryPop(&pipeline->freeOutputChunks, (void **) &chunk)) {
+        chunk = DynamicAllocatorRealloc(NULL, NULL, 0, sizeof(*chunk));
+        assert(chunk != NULL && "Buy more RAM!!!");
+        memset(chunk, 0, sizeof(*chunk));
+    }
+    DynamicString filled = *output_ds;
+    *output_ds = *chunk;
+    DynamicStringClear(output_ds);
+    *chunk = filled;
+    PipelinePush(pipeline, &pipeline->outputChunks, chunk, false);
+}
+
+int PipelineWriterThread(void *arg) {
+    MacroPipeline *pipeline = arg;
+    bool ok = true;
+    for (;;) {
+        DynamicString *chunk = NULL;
+        PipelinePop(pipeline, &pipeline->outputChunks, (void **) &chunk);
+        if (!chunk) break;
+
+        if (ok && fwrite(chunk->data, 1, chunk->count, pipeline->outputFile) != chunk->count) {
+            fprintf(stderr, "Could not fwrite output: %s\n", strerror(errno));
+            ok = false;
+        }
+        DynamicStringClear(chunk);
+        bool pushed = SpscRingTryPush(&pipeline->freeOutputChunks, chunk);
+        assert(pushed && "Free output chunk ring is full");
+    }
+    return ok ? 0 : 1;
+}
+
+void PipelineDrainChunks(SpscRing *ring) {
+    DynamicString *chunk = NULL;
+    while (SpscRingTryPop(ring, (void **) &chunk)) {
+        if (!chunk) continue;
+        DynamicStringDestroy(chunk);
+        DynamicAllocatorFree(NULL, chunk, sizeof(*chunk));
+    }
+}
+
+void PipelineDrainBatches(MacroPipeline *pipeline, SpscRing *ring) {
+    TokenBatch *batch = NULL;
+    while (SpscRingTryPop(ring, (void **) &batch)) {
+        DynamicAllocatorFree(&pipeline->batchAllocator, batch, sizeof(*batch));
+    }
+}
+
+#endif // MACROLANG_PIPELINE
+
+// an input can switch to its own syntax with "<prefix>syntax <spec>" as its first line, written in the syntax
+// it is read with, see MacroSyntaxParse(), the lexer is moved past that line
+bool MacroSyntaxHeader(Lexer *lexer, MacroSyntax *syntax) {
+    LexerMark mark = GetMark(lexer);
+    lexer->syntax = syntax;
+    if (GetToken(lexer).type != TokenSyntaxKeyword) {
+        SetMark(lexer, mark);
+        return true;
+    }
+
+    const char *spec = &LexerCurrent(lexer);
+    size_t spec_len = 0;
+    while (lexer->current + spec_len < lexer->data_len && spec[spec_len] != '\n') spec_len++;
+    MacroSyntax parsed = *syntax;
+    if (!MacroSyntaxParse(&parsed, spec, spec_len)) {
+        MacroReportError(lexer, "Invalid %c" Token_Fmt " line", syntax->keywordPrefix, Token_Arg(MacroSyntaxKeyword(syntax, TokenSyntaxKeyword)));
+        return false;
+    }
+    *syntax = parsed;
+    lexer->current += spec_len;
+    LexerNext(lexer);
+    return true;
+}
+
 bool MacroLang(Lexer *lexer, DynamicString *output_ds) {
+    DynamicArenaInit(&DefinedMacros.arena);
+    DynamicArenaInit(&ExpansionArena);
+
+    bool ok = true; // a bad definition does not stop the expansion, so every one of them is reported
     for (Token token = GetToken(lexer);
          token.type != TokenEnd;
          token = GetToken(lexer)) {
         if (token.type == TokenMacroKeyword) {
-            MacroDefine(lexer);
-        } else if (token.type == TokenText) {
+            if (!MacroDefine(lexer)) ok = false;
+            DynamicArenaClear(&ExpansionArena);
+        } else if (token.type == TokenPushKeyword) {
+            if (!MacroDirectiveEnd(lexer, TokenPushKeyword)) return false;
+            MacroPushScope();
+        } else if (token.type == TokenPopKeyword) {
+            if (!MacroDirectiveEnd(lexer, TokenPopKeyword)) return false;
+            if (!MacroPopScope(lexer)) return false;
+        } else if (token.type == TokenUndefKeyword) {
+            if (!MacroUndef(lexer)) return false;
+        } else if (token.type == TokenSyntaxKeyword) {
+            MacroReportError(lexer, "%c" Token_Fmt " can only be used on the first line", lexer->syntax->keywordPrefix, Token_Arg(&token));
+            return false;
+        } else if (token.type == TokenText && FindMatchingMacro(token)) {
+            Macro *macro = FindMatchingMacro(token);
             Tokens expandedTokens = {
+                .allocator = &ExpansionArena.allocator,
                 .printFunc = printToken,
             };
-            Macro *macro = FindMatchingMacro(token);
-            if (!macro) {
-                DynamicArrayAppend(&expandedTokens, token);
-            } else if (macro->type == MacroValue) {
-                Tokens macroTokens = {
-                    .printFunc = printToken,
-                };
-                DynamicArrayAppend(&macroTokens, token);
-                if (!MacroExpand(&macroTokens, &expandedTokens)) return false;
-                DynamicArrayDestroy(&macroTokens);
-            } else if (macro->type == MacroArgs) {
-                Tokens macroTokens = {
-                    .printFunc = printToken,
-                };
-                DynamicArrayAppend(&macroTokens, token);
+            Tokens macroTokens = {
+                .allocator = &ExpansionArena.allocator,
+                .printFunc = printToken,
+            };
+            DynamicArrayAppend(&macroTokens, token);
+            if (macro->type == MacroArgs) {
                 if (!MacroCollectArgs(lexer, macro, &macroTokens)) return false;
-                if (!MacroExpand(&macroTokens, &expandedTokens)) return false;
-                DynamicArrayDestroy(&macroTokens);
+                MacroMatchGroups(lexer->syntax, &macroTokens);
             }
+            if (!MacroExpand(lexer, (TokenSpan){macroTokens.data, macroTokens.count}, NULL, NULL, &expandedTokens)) return false;
             DynamicArrayForeach(Token, expandedToken, &expandedTokens) {
-                DynamicStringAppendf(output_ds, Token_Fmt, Token_Arg(expandedToken));
+                DynamicStringAppendStr(output_ds, expandedToken->data, expandedToken->data_len);
             }
-            DynamicArrayDestroy(&expandedTokens);
+            DynamicArenaClear(&ExpansionArena);
         } else {
-            DynamicStringAppendf(output_ds, Token_Fmt, Token_Arg(&token));
+            DynamicStringAppendStr(output_ds, token.data, token.data_len);
         }
+
+#ifdef MACROLANG_PIPELINE
+        if (lexer->pipeline && output_ds->count >= MACRO_PIPELINE_CHUNK_SIZE) {
+            PipelineFlushOutput(lexer->pipeline, output_ds);
+        }
+#endif // MACROLANG_PIPELINE
     }
+    return ok;
+}
 
-#ifdef DEBUG_PRINTING
-    printf("\n----- MACROS -----\n");
-    DynamicArrayPrint(&DefinedMacros);
-    printf("\n----- MACROS -----\n");
-#endif // DEBUG_PRINTING
+#ifdef MACROLANG_PIPELINE
+// runs MacroLang on this thread with the lexer and the writer on their own threads
+// the output is written to outputFile as it is produced instead of being collected
+bool MacroLangPipelined(Lexer *lexer, FILE *outputFile) {
+    MacroPipeline pipeline = {
+        .lexer = *lexer,
+        .outputFile = outputFile,
+    };
+    atomic_init(&pipeline.stop, false);
+    atomic_init(&pipeline.progress, 0);
+    atomic_init(&pipeline.sleepers, 0);
+    bool ok = SpscRingInit(&pipeline.tokenBatches, MACRO_PIPELINE_RING_SIZE) &&
+              SpscRingInit(&pipeline.freeTokenBatches, MACRO_PIPELINE_RING_SIZE * 2) &&
+              SpscRingInit(&pipeline.outputChunks, MACRO_PIPELINE_RING_SIZE) &&
+              SpscRingInit(&pipeline.freeOutputChunks, MACRO_PIPELINE_RING_SIZE * 2) &&
+              mtx_init(&pipeline.lock, mtx_plain) == thrd_success &&
+              cnd_init(&pipeline.wake) == thrd_success;
+    assert(ok && "Buy more RAM!!!");
+
+    thrd_t lexerThread, writerThread;
+    if (thrd_create(&lexerThread, PipelineLexerThread, &pipeline) != thrd_success) {
+        fprintf(stderr, "Could not start the lexer thread\n");
+        return false;
+    }
+    if (thrd_create(&writerThread, PipelineWriterThread, &pipeline) != thrd_success) {
+        fprintf(stderr, "Could not start the writer thread\n");
+        atomic_store(&pipeline.stop, true);
+        PipelineWake(&pipeline);
+        thrd_join(lexerThread, NULL);
+        return false;
+    }
+
+    lexer->pipeline = &pipeline;
+    DynamicString output_ds = {0};
+    ok = MacroLang(lexer, &output_ds);
+    lexer->pipeline = NULL;
 
+    // on failure the lexer may be blocked on a full ring, the writer still gets everything before the error
+    if (!ok) {
+        atomic_store(&pipeline.stop, true);
+        PipelineWake(&pipeline);
+    }
+    if (output_ds.count > 0) PipelineFlushOutput(&pipeline, &output_ds);
+    PipelinePush(&pipeline, &pipeline.outputChunks, NULL, false);
+
+    int writerResult = 0;
+    thrd_join(lexerThread, NULL);
+    thrd_join(writerThread, &writerResult);
+    ok = ok && writerResult == 0;
+
+    DynamicStringDestroy(&output_ds);
+    if (pipeline.batch) DynamicAllocatorFree(&pipeline.batchAllocator, pipeline.batch, sizeof(*pipeline.batch));
+    PipelineDrainBatches(&pipeline, &pipeline.tokenBatches);
+    PipelineDrainBatches(&pipeline, &pipeline.freeTokenBatches);
+    PipelineDrainChunks(&pipeline.outputChunks);
+    PipelineDrainChunks(&pipeline.freeOutputChunks);
+    SpscRingDestroy(&pipeline.tokenBatches);
+    SpscRingDestroy(&pipeline.freeTokenBatches);
+    SpscRingDestroy(&pipeline.outputChunks);
+    SpscRingDestroy(&pipeline.freeOutputChunks);
+    cnd_destroy(&pipeline.wake);
+    mtx_destroy(&pipeline.lock);
+#    ifdef DEBUG_PRINTING
+    // after every batch is freed, so bytes in use shows what leaked
+    DynamicAllocatorPrintStats("pipeline batch allocator", &pipeline.batchAllocator);
+#    endif // DEBUG_PRINTING
+    return ok;
+}
+
+#endif // MACROLANG_PIPELINE
+
+// everything that changes the output of the same input has to be part of the key
+CacheKey MacroCacheKey(const DynamicString *input_ds, const MacroSyntax *syntax) {
+    CacheKey key;
+    CacheKeyInit(&key);
+    CacheKeyAddString(&key, "macrolang " MACROLANG_VERSION);
+
+    const char delimiters[] = {syntax->keywordPrefix, syntax->argsStart, syntax->argsSeparator, syntax->argsEnd, syntax->variadicSymbol};
+    CacheKeyAdd(&key, delimiters, sizeof(delimiters));
+    for (size_t i = 0; i < ARRAY_LEN(syntax->keywords); i++) {
+        CacheKeyAdd(&key, syntax->keywords[i].data, syntax->keywords[i].data_len);
+        CacheKeyAdd(&key, &syntax->keywords[i].type, sizeof(syntax->keywords[i].type));
+    }
+
+    CacheKeyAdd(&key, input_ds->data, input_ds->count);
+    return key;
+}
+
+#ifdef MACROLANG_BATCH
+
+#    ifndef MACRO_BATCH_BUFFERS
+#        define MACRO_BATCH_BUFFERS (64) // inputs being read plus outputs being written at once
+#    endif // MACRO_BATCH_BUFFERS
+#    ifndef MACRO_BATCH_WORKERS
+#        define MACRO_BATCH_WORKERS (8) // io threads when io_uring is not available
+#    endif // MACRO_BATCH_WORKERS
+
+typedef struct {
+    const char *input;
+    const char *output;
+} MacroBatchJob;
+
+DynamicArrayDef(MacroBatchJobs, MacroBatchJob);
+
+// buffers are reused from job to job, each one has its own allocator since io threads grow them
+// and DynamicDefaultAllocator is not thread safe
+typedef struct {
+    AsyncIORequest request;
+    DynamicString data;
+    DynamicAllocator allocator;
+    const MacroBatchJob *job;
+} MacroBatchBuffer;
+
+// one job per line: <input>\t<output>, the lines are parsed in place
+bool MacroBatchParseList(DynamicString *list_ds, const char *list_file, MacroBatchJobs *jobs) {
+    char *line = list_ds->data;
+    char *end = list_ds->data + list_ds->count;
+    for (size_t line_number = 1; line < end; line_number++) {
+        char *line_end = memchr(line, '\n', (size_t) (end - line));
+        if (!line_end) line_end = end;
+        *line_end = '\0';
+
+        if (line != line_end) {
+            char *tab = memchr(line, '\t', (size_t) (line_end - line));
+            if (!tab || tab == line || tab + 1 == line_end) {
+                fprintf(stderr, "%s:%zu: Expected <input>\\t<output>\n", list_file, line_number);
+                return false;
+            }
+            *tab = '\0';
+            MacroBatchJob job = {
+                .input = line,
+                .output = tab + 1,
+            };
+            DynamicArrayAppend(jobs, job);
+        }
+        line = line_end + 1;
+    }
     return true;
 }
 
+// expands a job whose input was just read, returns the buffer holding its output
+MacroBatchBuffer *MacroBatchExpand(MacroBatchBuffer *input, MacroBatchBuffer *output, const char *cache_dir, const MacroSyntax *syntax) {
+    const MacroBatchJob *job = input->job;
+    DynamicStringRemoveAll(&input->data, '\r');
+
+    CacheKey cache_key = {0};
+    if (cache_dir) {
+        cache_key = MacroCacheKey(&input->data, syntax);
+        char entry_path[4096];
+        if (OutputCacheLookup(cache_dir, cache_key, entry_path, sizeof(entry_path))) {
+            if (!OutputCachePlace(entry_path, job->output)) {
+                fprintf(stderr, "Could not place the cached output of \"%s\" at \"%s\"\n", job->input, job->output);
+                return NULL;
+            }
+            return input;
+        }
+    }
+
+    MacroTableReset();
+    MacroSyntax file_syntax = *syntax;
+    Lexer lexer = {
+        .data = input->data.data,
+        .data_len = input->data.count,
+    };
+    output->data.count = 0;
+    if (!MacroSyntaxHeader(&lexer, &file_syntax) || !MacroLang(&lexer, &output->data)) {
+        fprintf(stderr, "Could not expand \"%s\"\n", job->input);
+        return NULL;
+    }
+    if (cache_dir) OutputCacheStore(cache_dir, cache_key, &output->data);
+    output->job = job;
+    return output;
+}
+
+// reads of the next inputs and writes of the previous outputs are in flight while a file is expanded
+// the files of one batch are independent, every one of them starts with no macros defined
+bool MacroLangBatch(const char *list_file, const char *cache_dir, const MacroSyntax *syntax) {
+    DynamicString list_ds = {0};
+    MacroBatchJobs jobs = {0};
+    if (!DynamicStringReadFile(&list_ds, list_file)) return false;
+    DynamicStringRemoveAll(&list_ds, '\r');
+    if (!MacroBatchParseList(&list_ds, list_file, &jobs)) return false;
+
+    AsyncIO io;
+    if (!AsyncIOInit(&io, MACRO_BATCH_BUFFERS, MACRO_BATCH_WORKERS)) {
+        fprintf(stderr, "Could not start async io\n");
+        return false;
+    }
+
+    MacroBatchBuffer buffers[MACRO_BATCH_BUFFERS] = {0};
+    MacroBatchBuffer *free_buffers[MACRO_BATCH_BUFFERS];
+    size_t free_count = 0;
+    for (size_t i = 0; i < MACRO_BATCH_BUFFERS; i++) {
+        buffers[i].data.allocator = &buffers[i].allocator;
+        free_buffers[free_count++] = &buffers[i];
+    }
+
+    // one free buffer is always kept for the output of the next input that finishes reading
+    size_t next_job = 0, failed = 0;
+    for (;;) {
+        while (next_job < jobs.count && free_count > 1) {
+            MacroBatchBuffer *buffer = free_buffers[--free_count];
+            buffer->job = &jobs.data[next_job++];
+            buffer->data.count = 0;
+            buffer->request = (AsyncIORequest){
+                .op = AsyncIORead,
+                .path = buffer->job->input,
+                .buffer = &buffer->data,
+                .userData = buffer,
+            };
+            AsyncIOSubmit(&io, &buffer->request);
+        }
+
+        AsyncIORequest *request = AsyncIOWait(&io);
+        if (!request) break;
+        MacroBatchBuffer *buffer = request->userData;
+
+        if (request->error != 0) {
+            fprintf(stderr, "Could not %s \"%s\": %s\n", request->op == AsyncIORead ? "read" : "write",
+                    request->path, strerror(request->error));
+            failed++;
+        } else if (request->op == AsyncIORead) {
+            MacroBatchBuffer *output = MacroBatchExpand(buffer, free_buffers[free_count - 1], cache_dir, syntax);
+            if (!output) {
+                failed++;
+            } else if (output != buffer) {
+                free_count--;
+                output->request = (AsyncIORequest){
+                    .op = AsyncIOWrite,
+                    .path = output->job->output,
+                    .buffer = &output->data,
+                    .userData = output,
+                };
+                AsyncIOSubmit(&io, &output->request);
+            }
+        }
+        free_buffers[free_count++] = buffer;
+    }
+
+    AsyncIODestroy(&io);
+#    ifdef DEBUG_PRINTING
+    DynamicAllocator io_stats = {0};
+    for (size_t i = 0; i < MACRO_BATCH_BUFFERS; i++) {
+        io_stats.reallocCount += buffers[i].allocator.reallocCount;
+        io_stats.freeCount += buffers[i].allocator.freeCount;
+        io_stats.bytesRequested += buffers[i].allocator.bytesRequested;
+        io_stats.bytesInUse += buffers[i].allocator.bytesInUse;
+        io_stats.bytesPeak += buffers[i].allocator.bytesPeak;
+    }
+    DynamicAllocatorPrintStats("batch buffers", &io_stats);
+    fprintf(stderr, "batch: %zu files, %zu failed, %s\n", jobs.count, failed, io.uring ? "io_uring" : "io threads");
+#    endif // DEBUG_PRINTING
+
+    for (size_t i = 0; i < MACRO_BATCH_BUFFERS; i++) {
+        DynamicStringDestroy(&buffers[i].data);
+    }
+    DynamicArrayDestroy(&jobs);
+    DynamicStringDestroy(&list_ds);
+    return failed == 0;
+}
+
+#endif // MACROLANG_BATCH
+
 #define POP_ARG(arr, c) ((c)--, *(arr)++)
 
 void usage(const char *program_name) {
-    fprintf(stderr, "%s <input>\n", program_name);
+    fprintf(stderr, "%s [--cache <dir>] [--syntax <spec>] <input> [output]\n", program_name);
+#ifdef MACROLANG_BATCH
+    fprintf(stderr, "%s [--cache <dir>] [--syntax <spec>] --batch <list>\n", program_name);
+    fprintf(stderr, "    <list> has one <input>\\t<output> pair per line\n");
+#endif // MACROLANG_BATCH
+    fprintf(stderr, "    <spec> is \"<prefix><start><separator><end>[<variadic>] [<keyword>=<name>]...\", e.g. \"@[;]\"\n");
 }
 
 int main(int argc, char **argv) {
-#if 0
+    MacroSyntax syntax;
+    MacroSyntaxInit(&syntax);
+    if (!MacroSyntaxBuild(&syntax)) return 1;
+
+#ifndef MACROLANG_DEBUG_INPUT // define it to expand the hardcoded input below instead of the command line
     const char *program_name = POP_ARG(argv, argc);
+    const char *cache_dir = NULL;
+#    ifdef MACROLANG_BATCH
+    const char *batch_list = NULL;
+#    endif // MACROLANG_BATCH
+
+    while (argc > 0 && strncmp(argv[0], "--", 2) == 0) {
+        const char *flag = POP_ARG(argv, argc);
+        if (strcmp(flag, "--cache") == 0) {
+            if (argc <= 0) {
+                usage(program_name);
+                fprintf(stderr, "No Cache Directory Provided\n");
+                return 1;
+            }
+            cache_dir = POP_ARG(argv, argc);
+        } else if (strcmp(flag, "--syntax") == 0) {
+            if (argc <= 0) {
+                usage(program_name);
+                fprintf(stderr, "No Syntax Provided\n");
+                return 1;
+            }
+            const char *spec = POP_ARG(argv, argc);
+            if (!MacroSyntaxParse(&syntax, spec, strlen(spec))) return 1;
+#    ifdef MACROLANG_BATCH
+        } else if (strcmp(flag, "--batch") == 0) {
+            if (argc <= 0) {
+                usage(program_name);
+                fprintf(stderr, "No Batch List Provided\n");
+                return 1;
+            }
+            batch_list = POP_ARG(argv, argc);
+#    endif // MACROLANG_BATCH
+        } else {
+            usage(program_name);
+            fprintf(stderr, "Unknown Flag \"%s\"\n", flag);
+            return 1;
+        }
+    }
+
+#    ifdef MACROLANG_BATCH
+    if (batch_list) return MacroLangBatch(batch_list, cache_dir, &syntax) ? 0 : 1;
+#    endif // MACROLANG_BATCH
 
     if (argc <= 0) {
         usage(program_name);
@@ -496,12 +1799,15 @@ int main(int argc, char **argv) {
     }
 
     const char *input_file = POP_ARG(argv, argc);
+    const char *output_file = argc > 0 ? POP_ARG(argv, argc) : NULL;
 #else
     (void) argc;
     (void) argv;
     // hardcoded for easy debugging in vscode
     const char *input_file = "C:\\Users\\idosw\\C_Projects\\macrolang\\testing.txt";
-#endif
+    const char *output_file = NULL;
+    const char *cache_dir = NULL;
+#endif // MACROLANG_DEBUG_INPUT
 
     DynamicString input_ds = {0};
     DynamicStringReadFile(&input_ds, input_file);
@@ -514,17 +1820,70 @@ int main(int argc, char **argv) {
     printf("\n----- INPUT -----\n");
 #endif // DEBUG_PRINTING
 
+    // a cache hit skips lexing and expanding, the entry is placed at output_file or loaded as the output
+    DynamicString output_ds = {0};
+    CacheKey cache_key = {0};
+    bool cache_hit = false;
+    if (cache_dir) {
+        cache_key = MacroCacheKey(&input_ds, &syntax);
+        char entry_path[4096];
+        if (OutputCacheLookup(cache_dir, cache_key, entry_path, sizeof(entry_path))) {
+            if (output_file) return OutputCachePlace(entry_path, output_file) ? 0 : 1;
+            if (!DynamicStringReadFile(&output_ds, entry_path)) return 1;
+            cache_hit = true;
+        }
+    }
+
     Lexer lexer = {
         .data = input_ds.data,
         .data_len = input_ds.count,
     };
-    DynamicString output_ds = {0};
-    if (!MacroLang(&lexer, &output_ds)) return 1;
+    if (!cache_hit && !MacroSyntaxHeader(&lexer, &syntax)) return 1;
+#ifdef MACROLANG_PIPELINE
+    if (cache_hit) {
+        if (output_ds.count > 0) fwrite(output_ds.data, 1, output_ds.count, stdout);
+    } else {
+        // without an output file the writer thread streams to stdout, and nothing can be cached
+        FILE *output = stdout;
+        if (output_file) {
+            output = fopen(output_file, "wb");
+            if (!output) {
+                fprintf(stderr, "Could not fopen \"%s\": %s\n", output_file, strerror(errno));
+                return 1;
+            }
+        }
+        bool ok = MacroLangPipelined(&lexer, output);
+        if (output != stdout) fclose(output);
+        if (!ok) {
+            // the output before the error was already written, a partial file must not look like a result
+            if (output_file) remove(output_file);
+            return 1;
+        }
+        if (cache_dir && output_file) OutputCacheStoreFile(cache_dir, cache_key, output_file);
+    }
+#else
+    if (!cache_hit) {
+        if (!MacroLang(&lexer, &output_ds)) return 1;
+        if (cache_dir) OutputCacheStore(cache_dir, cache_key, &output_ds);
+
+#    ifdef DEBUG_PRINTING
+        // printed here and not in MacroLang(), the batch mode would print it for every file
+        printf("\n----- MACROS -----\n");
+        DynamicArrayPrint(&DefinedMacros.macros);
+        printf("\n----- MACROS -----\n");
+#    endif // DEBUG_PRINTING
+    }
+    if (output_file && !DynamicStringWriteFile(output_file, &output_ds)) return 1;
 
-#ifdef DEBUG_PRINTING
+#    ifdef DEBUG_PRINTING
     printf("\n----- OUTPUT -----\n");
     DynamicStringPrint(&output_ds);
     printf("\n----- OUTPUT -----\n");
+#    endif // DEBUG_PRINTING
+#endif // MACROLANG_PIPELINE
+
+#ifdef DEBUG_PRINTING
+    DynamicAllocatorPrintStats("default allocator", NULL);
 #endif // DEBUG_PRINTING
 
     return 0;
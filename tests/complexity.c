@@ -0,0 +1,295 @@
+// complexity regression suite for macrolang
+// every case generates a worst case input at a small and a COMPLEXITY_GROWTH times bigger size, runs macrolang on both
+// and fails when the big run goes over its wall time or peak RSS budget, or when growing the input made the time or
+// memory grow much more than the input did (a linear path turning quadratic)
+// posix only, tests/complexity.sh builds macrolang with -DMACROLANG_QUIET and runs this with it
+#define _DEFAULT_SOURCE
+
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#ifndef COMPLEXITY_GROWTH
+#    define COMPLEXITY_GROWTH (4) // the big input of a case is this many times the small one
+#endif // COMPLEXITY_GROWTH
+#ifndef COMPLEXITY_SLACK
+#    define COMPLEXITY_SLACK (2) // how much more than linear the growth may look before it is a regression
+#endif // COMPLEXITY_SLACK
+#ifndef COMPLEXITY_MIN_SECONDS
+#    define COMPLEXITY_MIN_SECONDS (0.01) // small runs faster than this are too noisy to compare against, every case is sized well above it
+#endif // COMPLEXITY_MIN_SECONDS
+#ifndef COMPLEXITY_RUNS
+#    define COMPLEXITY_RUNS (3) // the fastest of these runs is the time of an input
+#endif // COMPLEXITY_RUNS
+#ifndef COMPLEXITY_DEEP_LINES
+#    define COMPLEXITY_DEEP_LINES (4000) // lines of nested calls in deep_nesting
+#endif // COMPLEXITY_DEEP_LINES
+#ifndef COMPLEXITY_DEEP_USES
+#    define COMPLEXITY_DEEP_USES (1000) // uses of an active macro per value in deep_active
+#endif // COMPLEXITY_DEEP_USES
+#ifndef COMPLEXITY_REPEATS
+#    define COMPLEXITY_REPEATS (8) // expansions of the same input in the cases whose memory would grow with more of them
+#endif // COMPLEXITY_REPEATS
+
+typedef void (*ComplexityGenerator)(FILE *file, size_t n);
+
+typedef struct {
+    const char *name;
+    ComplexityGenerator generate;
+    size_t n;           // size of the small input
+    int expectedStatus; // exit status of macrolang on both inputs
+    double maxSeconds;  // budgets of the big input
+    long maxRssKb;
+} ComplexityCase;
+
+typedef struct {
+    double seconds;
+    long rssKb;
+    int status; // -1 when it did not exit normally
+    bool timedOut;
+} ComplexityRun;
+
+// one line of n calls
+void GenerateLongLine(FILE *file, size_t n) {
+    fprintf(file, "#macro A(x, y) x->y\n");
+    for (size_t i = 0; i < n; i++) {
+        fprintf(file, "A(%zu, w%zu) text ", i, i);
+    }
+    fprintf(file, "\n");
+}
+
+// lines of calls nested n invocations deep inside each others arguments, directly and through a forwarding macro
+// n has to stay under MACRO_MAX_EXPANSION_DEPTH
+void GenerateDeepNesting(FILE *file, size_t n) {
+    fprintf(file, "#macro A(y) (y)\n#macro B(x) A(x)\n");
+    for (size_t line = 0; line < COMPLEXITY_DEEP_LINES; line++) {
+        const char *name = line % 2 ? "A(" : "B(";
+        size_t depth = line % 2 ? n : n / 2;
+        for (size_t i = 0; i < depth; i++) fputs(name, file);
+        fprintf(file, "%zu", line);
+        for (size_t i = 0; i < depth; i++) fputc(')', file);
+        fputc('\n', file);
+    }
+}
+
+// a chain of n value macros, each with uses of a macro that is active at that point
+// n has to stay under MACRO_MAX_EXPANSION_DEPTH
+void GenerateDeepActive(FILE *file, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        fprintf(file, "#macro M%zu M%zu", i, i + 1);
+        for (size_t j = 0; j < COMPLEXITY_DEEP_USES; j++) fputs(" M0", file);
+        fputc('\n', file);
+    }
+    fprintf(file, "#macro M%zu end\n", n);
+    for (size_t i = 0; i < COMPLEXITY_REPEATS; i++) fputs("M0\n", file);
+}
+
+// n nested calls, far over the expansion limit, has to fail quickly instead of overflowing the stack
+void GenerateTooDeep(FILE *file, size_t n) {
+    fprintf(file, "#macro A(y) (y)\n");
+    for (size_t i = 0; i < n; i++) fputs("A(", file);
+    fputc('1', file);
+    for (size_t i = 0; i < n; i++) fputc(')', file);
+    fputc('\n', file);
+}
+
+// a macro with n parameters that all appear in its value, called directly and through a forwarding variadic macro, both of them repeated
+void GenerateManyParams(FILE *file, size_t n) {
+    fprintf(file, "#macro M(");
+    for (size_t i = 0; i < n; i++) fprintf(file, "%sp%zu", i ? ", " : "", i);
+    fprintf(file, ")");
+    for (size_t i = 0; i < n; i++) fprintf(file, " p%zu", n - 1 - i);
+    fprintf(file, "\n#macro F(xs...) M(xs) #count(xs)\n");
+    for (size_t call = 0; call < COMPLEXITY_REPEATS * 2; call++) {
+        fprintf(file, "%s(", call % 2 ? "F" : "M");
+        for (size_t i = 0; i < n; i++) fprintf(file, "%s%zu", i ? ", " : "", i);
+        fprintf(file, ")\n");
+    }
+}
+
+// n macros, half of them redefined in a scope, every one of them used repeatedly inside and outside of it
+void GenerateHugeTable(FILE *file, size_t n) {
+    for (size_t i = 0; i < n; i++) fprintf(file, "#macro m%zu v%zu\n", i, i);
+    fprintf(file, "#push\n");
+    for (size_t i = 0; i < n; i += 2) fprintf(file, "#macro m%zu inner%zu\n", i, i);
+    for (int scope = 0; scope < 2; scope++) {
+        for (size_t use = 0; use < COMPLEXITY_REPEATS / 2; use++) {
+            for (size_t i = 0; i < n; i++) fprintf(file, "m%zu%c", i, i % 16 == 15 ? '\n' : ' ');
+            fprintf(file, "\n");
+        }
+        if (scope == 0) fprintf(file, "#pop\n");
+    }
+}
+
+// n invalid definitions at the end of a long line, every error shows the line it is on and the expansion goes on after it
+void GenerateErrorHeavy(FILE *file, size_t n) {
+    for (size_t i = 0; i < n * 10; i++) fputs("x ", file);
+    for (size_t i = 0; i < n; i++) fputs("#macro ", file);
+    fputc('\n', file);
+    for (size_t i = 0; i < n; i++) fputs("#macro 1\n", file);
+}
+
+// n bytes of noise, most of them are not part of the syntax
+// the keyword prefix is left out, with it megabytes of noise spell out directives by chance
+void GenerateBinary(FILE *file, size_t n) {
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < n; i++) {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        int c = (int) (state >> 56);
+        fputc(c == '#' ? ' ' : c, file);
+    }
+}
+
+// budgets are several times what a linear build takes on a slow machine, growth catches what they are too loose for
+ComplexityCase Cases[] = {
+    {"long_line", GenerateLongLine, 500000, 0, 5.0, 512 * 1024},
+    {"deep_nesting", GenerateDeepNesting, 250, 0, 5.0, 256 * 1024},
+    {"deep_active", GenerateDeepActive, 250, 0, 5.0, 512 * 1024},
+    {"too_deep", GenerateTooDeep, 500000, 1, 2.0, 1024 * 1024},
+    {"many_params", GenerateManyParams, 40000, 0, 5.0, 256 * 1024},
+    {"huge_table", GenerateHugeTable, 50000, 0, 5.0, 1024 * 1024},
+    {"error_heavy", GenerateErrorHeavy, 100000, 1, 5.0, 256 * 1024},
+    {"binary", GenerateBinary, 8 * 1024 * 1024, 0, 5.0, 256 * 1024},
+};
+
+#define ARRAY_LEN(arr) (sizeof((arr)) / sizeof(*(arr)))
+
+double Now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+bool ComplexityGenerate(const ComplexityCase *c, size_t n, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (!file) {
+        fprintf(stderr, "Could not fopen \"%s\"\n", path);
+        return false;
+    }
+    c->generate(file, n);
+    return fclose(file) == 0;
+}
+
+// runs macrolang once with its stdout and stderr thrown away, it is killed after timeout seconds
+ComplexityRun ComplexityRunOnce(const char *macrolang, const char *input, const char *output, double timeout) {
+    ComplexityRun run = {.status = -1};
+    double start = Now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return run;
+    }
+    if (pid == 0) {
+        int devNull = open("/dev/null", O_WRONLY);
+        if (devNull >= 0) {
+            dup2(devNull, STDOUT_FILENO);
+            dup2(devNull, STDERR_FILENO);
+        }
+        execl(macrolang, macrolang, input, output, (char *) NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage = {0};
+    for (;;) {
+        pid_t done = wait4(pid, &status, WNOHANG, &usage);
+        if (done == pid) break;
+        if (done < 0) {
+            perror("wait4");
+            return run;
+        }
+        if (!run.timedOut && Now() - start > timeout) {
+            kill(pid, SIGKILL);
+            run.timedOut = true;
+        }
+        usleep(1000);
+    }
+    run.seconds = Now() - start;
+    run.rssKb = usage.ru_maxrss; // KB on linux
+    if (WIFEXITED(status)) run.status = WEXITSTATUS(status);
+    return run;
+}
+
+// the fastest of COMPLEXITY_RUNS runs and the biggest peak RSS, stops at the first run that goes wrong
+ComplexityRun ComplexityMeasure(const char *macrolang, const char *input, const char *output, double timeout) {
+    ComplexityRun best = {0};
+    for (int i = 0; i < COMPLEXITY_RUNS; i++) {
+        ComplexityRun run = ComplexityRunOnce(macrolang, input, output, timeout);
+        if (i == 0 || run.seconds < best.seconds) best.seconds = run.seconds;
+        if (run.rssKb > best.rssKb) best.rssKb = run.rssKb;
+        best.status = run.status;
+        best.timedOut = run.timedOut;
+        if (run.timedOut || run.status < 0) break;
+    }
+    return best;
+}
+
+bool ComplexityCheck(const char *macrolang, const char *workDir, const ComplexityCase *c) {
+    char input[4096], output[4096];
+    snprintf(input, sizeof(input), "%s/%s.txt", workDir, c->name);
+    snprintf(output, sizeof(output), "%s/%s.out", workDir, c->name);
+
+    ComplexityRun runs[2];
+    size_t sizes[2] = {c->n, c->n * COMPLEXITY_GROWTH};
+    for (int i = 0; i < 2; i++) {
+        if (!ComplexityGenerate(c, sizes[i], input)) return false;
+        // the small input gets the budget too, a timeout there still has to end the case
+        runs[i] = ComplexityMeasure(macrolang, input, output, c->maxSeconds);
+    }
+    remove(input);
+    remove(output);
+
+    const char *failure = NULL;
+    double timeGrowth = runs[1].seconds / (runs[0].seconds > COMPLEXITY_MIN_SECONDS ? runs[0].seconds : COMPLEXITY_MIN_SECONDS);
+    double rssGrowth = (double) runs[1].rssKb / (double) (runs[0].rssKb > 0 ? runs[0].rssKb : 1);
+    if (runs[0].timedOut || runs[1].timedOut) {
+        failure = "timed out";
+    } else if (runs[0].status != c->expectedStatus || runs[1].status != c->expectedStatus) {
+        failure = "unexpected exit status";
+    } else if (runs[1].seconds > c->maxSeconds) {
+        failure = "over the time budget";
+    } else if (runs[1].rssKb > c->maxRssKb) {
+        failure = "over the memory budget";
+    } else if (timeGrowth > COMPLEXITY_GROWTH * COMPLEXITY_SLACK) {
+        failure = "time grows faster than the input";
+    } else if (rssGrowth > COMPLEXITY_GROWTH * COMPLEXITY_SLACK) {
+        failure = "memory grows faster than the input";
+    }
+
+    printf("%-14s n=%-9zu %7.3fs %8ldKB status %-3d | n=%-9zu %7.3fs %8ldKB status %-3d | x%.1f time x%.1f rss  %s\n",
+           c->name, sizes[0], runs[0].seconds, runs[0].rssKb, runs[0].status,
+           sizes[1], runs[1].seconds, runs[1].rssKb, runs[1].status, timeGrowth, rssGrowth, failure ? failure : "ok");
+    return failure == NULL;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "%s <macrolang> <work dir> [case]...\n", argv[0]);
+        fprintf(stderr, "    <macrolang> should be built with -DMACROLANG_QUIET, the debug printing is not what is being timed\n");
+        return 1;
+    }
+    const char *macrolang = argv[1];
+    const char *workDir = argv[2];
+
+    size_t failed = 0, ran = 0;
+    for (size_t i = 0; i < ARRAY_LEN(Cases); i++) {
+        bool selected = argc == 3;
+        for (int arg = 3; arg < argc && !selected; arg++) selected = strcmp(argv[arg], Cases[i].name) == 0;
+        if (!selected) continue;
+        ran++;
+        if (!ComplexityCheck(macrolang, workDir, &Cases[i])) failed++;
+    }
+    printf("%zu/%zu complexity cases passed\n", ran - failed, ran);
+    return failed == 0 && ran > 0 ? 0 : 1;
+}
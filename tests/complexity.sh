@@ -0,0 +1,13 @@
+#!/bin/sh
+# builds macrolang and the complexity suite, then runs every case (or the ones named as arguments)
+# exits non zero when any case goes over its time or memory budget, so it can gate a build
+# CC and CFLAGS are used when set
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+${CC:-cc} ${CFLAGS:--O2} -DMACROLANG_QUIET -o "$work/macrolang" "$root/macrolang.c"
+${CC:-cc} -O2 -o "$work/complexity" "$root/tests/complexity.c"
+"$work/complexity" "$work/macrolang" "$work" "$@"
@@ -0,0 +1,24 @@
+#!/bin/sh
+# builds macrolang and expands every tests/outputs/<name>.txt, comparing the output with <name>.expected
+# exits non zero when any output differs, so it can gate a build
+# CC and CFLAGS are used when set
+set -e
+
+root=$(cd "$(dirname "$0")/.." && pwd)
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+${CC:-cc} ${CFLAGS:--O2} -DMACROLANG_QUIET -o "$work/macrolang" "$root/macrolang.c"
+
+failed=0
+for input in "$root"/tests/outputs/*.txt; do
+    name=$(basename "$input" .txt)
+    if "$work/macrolang" "$input" "$work/$name.out" && cmp -s "${input%.txt}.expected" "$work/$name.out"; then
+        echo "$name ok"
+    else
+        echo "$name FAILED"
+        diff "${input%.txt}.expected" "$work/$name.out" || true
+        failed=1
+    fi
+done
+exit $failed